@@ -0,0 +1,159 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#ifndef ALLOCATIONS_H
+#define ALLOCATIONS_H
+
+#include <cstdlib>
+#include <new>
+#include "Structures.h"
+
+// COUNTED ALLOCATIONS
+// Replaces the global operator new and delete, in all their forms, so that every allocation is
+// counted for the Hypergraph that the thread is working on (see HotCounters and CounterScope).
+// Include it in the one translation unit of a program.
+
+// The allocation function is not inlined into the operators, so that the compiler does not
+// take free() to be called on memory from operator new. Returns nullptr if the memory cannot be had.
+__attribute__((noinline)) void* raw_allocation(size_t size, size_t alignment){
+    if (alignment <= alignof(max_align_t))
+        return malloc(size);
+    
+    void* p = nullptr;
+    if (posix_memalign(&p, alignment, size) != 0)
+        return nullptr;
+    return p;
+}
+
+__attribute__((noinline)) void counted_free(void* p){
+    free(p);
+}
+
+// As the standard operator new: while the allocation fails, calls the new handler, which may
+// free some memory, and throws bad_alloc once there is none.
+void* counted_new(size_t size, size_t alignment){
+    HotCounters& c = hot_counters();
+    c.allocations++;
+    c.bytes_allocated += size;
+    
+    if (size == 0)
+        size = 1;
+    
+    void* p;
+    while ((p = raw_allocation(size, alignment)) == nullptr){
+        new_handler handler = get_new_handler();
+        if (handler == nullptr)
+            throw bad_alloc();
+        handler();
+    }
+    return p;
+}
+
+// The nothrow forms behave as the throwing ones, except that they return nullptr in place of
+// the bad_alloc.
+void* counted_new_nothrow(size_t size, size_t alignment) noexcept{
+    try{
+        return counted_new(size, alignment);
+    }
+    catch (const bad_alloc&){
+        return nullptr;
+    }
+}
+
+void* operator new(size_t size){
+    return counted_new(size, 0);
+}
+
+void* operator new[](size_t size){
+    return counted_new(size, 0);
+}
+
+void* operator new(size_t size, align_val_t alignment){
+    return counted_new(size, (size_t) alignment);
+}
+
+void* operator new[](size_t size, align_val_t alignment){
+    return counted_new(size, (size_t) alignment);
+}
+
+void* operator new(size_t size, const nothrow_t&) noexcept{
+    return counted_new_nothrow(size, 0);
+}
+
+void* operator new[](size_t size, const nothrow_t&) noexcept{
+    return counted_new_nothrow(size, 0);
+}
+
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept{
+    return counted_new_nothrow(size, (size_t) alignment);
+}
+
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept{
+    return counted_new_nothrow(size, (size_t) alignment);
+}
+
+void operator delete(void* p) noexcept{
+    counted_free(p);
+}
+
+void operator delete[](void* p) noexcept{
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept{
+    counted_free(p);
+}
+
+void operator delete(void* p, align_val_t) noexcept{
+    counted_free(p);
+}
+
+void operator delete[](void* p, align_val_t) noexcept{
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t, align_val_t) noexcept{
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t, align_val_t) noexcept{
+    counted_free(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept{
+    counted_free(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept{
+    counted_free(p);
+}
+
+void operator delete(void* p, align_val_t, const nothrow_t&) noexcept{
+    counted_free(p);
+}
+
+void operator delete[](void* p, align_val_t, const nothrow_t&) noexcept{
+    counted_free(p);
+}
+
+#endif
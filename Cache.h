@@ -0,0 +1,449 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <functional>
+#include <memory>
+#include "Variety.h"
+#include "Corpus.h"
+
+// PERSISTENT RESULT CACHE
+// The ai lists of Hypergraphs that were computed before are kept on disk under their canonical
+// form, so that a Hypergraph that is equal or isomorphic to one of them is not computed again.
+// The ai values are stored in the order of canonical labels: ai_canon[labeling[x]] = ai[x].
+//
+//   log   (file_name):        "WMVR", u32 version, then records. A record is its u32 length
+//                             followed by u64 hash, the number of vertices, the number of
+//                             Hyperedges, each Hyperedge as arity and labels, the number of ai
+//                             values and the values (varints as in Corpus.h).
+//   index (file_name + ".idx"): u64 hash and u64 offset of each record in the log.
+//
+// Both files are only appended to. If the index is missing or lags behind the log, it is rebuilt
+// from the log; a record cut at the end of the log (e.g. by a crash) is ignored.
+//
+// Within a run, a Hypergraph that is isomorphic to one still being computed waits for its result
+// instead of being computed again (see absolute_indifferences with a callback).
+
+const char CACHE_MAGIC[4] = {'W', 'M', 'V', 'R'};
+const unsigned int CACHE_VERSION = 1;
+const int CACHE_HEADER_SIZE = 8;
+
+// ai list in the order of canonical labels, and back. A non-Leibnizian {0} stays as it is.
+vector<int> ai_to_canonical(const vector<int>& ai, const vector<int>& labeling){
+    if (ai.size() != labeling.size())
+        return ai;
+    
+    vector<int> ai_canon(ai.size());
+    for (int x = 0; x < (int) ai.size(); x++)
+        ai_canon[labeling[x]] = ai[x];
+    return ai_canon;
+}
+
+vector<int> ai_from_canonical(const vector<int>& ai_canon, const vector<int>& labeling){
+    if (ai_canon.size() != labeling.size())
+        return ai_canon;
+    
+    vector<int> ai(ai_canon.size());
+    for (int x = 0; x < (int) ai.size(); x++)
+        ai[x] = ai_canon[labeling[x]];
+    return ai;
+}
+
+class ResultCache{
+
+private:
+    int log_fd = -1;
+    int index_fd = -1;
+    // Size of the log, taken by fstat when it is opened and advanced by each record appended.
+    // No record read from the log may end past it.
+    unsigned long long log_size = 0;
+    unsigned long long index_size = 0;
+    unordered_multimap<unsigned long long, unsigned long long> index;
+    
+    // A canonical form whose ai list is being computed, and the callbacks of the isomorphic
+    // Hypergraphs that wait for it, with the ai list in the order of canonical labels.
+    struct InFlight{
+        CanonicalForm cf;
+        vector<function<void(const vector<int>&)> > waiters;
+    };
+    unordered_multimap<unsigned long long, shared_ptr<InFlight> > in_flight;
+    
+    // Counts of this run.
+    atomic<long long> num_of_hits{0};
+    atomic<long long> num_of_misses{0};
+    atomic<long long> num_of_shared{0};
+    atomic<long long> num_of_not_canonical{0};
+    
+    // Encodes the payload of a record.
+    string encode(const CanonicalForm& cf, const vector<int>& ai_canon){
+        string buf;
+        
+        put_fixed(buf, cf.hash, 8);
+        put_varint(buf, cf.num_of_vertices);
+        put_varint(buf, cf.edges.size());
+        for (auto& e : cf.edges){
+            put_varint(buf, e.size());
+            for (int x : e)
+                put_varint(buf, x);
+        }
+        put_varint(buf, ai_canon.size());
+        for (int a : ai_canon)
+            put_zigzag(buf, a);
+        
+        return buf;
+    };
+    
+    // Reads the record at offset. Returns false if it cannot be read or does not match cf. A
+    // record must end by end, the size of the log as it is known, so that a corrupt length is
+    // not allocated.
+    bool read_record(unsigned long long offset, unsigned long long end_of_log, const CanonicalForm& cf, vector<int>& ai_canon){
+        unsigned char head[4];
+        
+        if ((offset + 4 > end_of_log) || (pread(log_fd, head, 4, offset) != 4))
+            return false;
+        
+        unsigned long long length = get_fixed(head, 4);
+        if ((length < 8) || (offset + 4 + length > end_of_log))
+            return false;
+        
+        string buf(length, '\0');
+        if ((unsigned long long) pread(log_fd, &buf[0], length, offset + 4) != length)
+            return false;
+        
+        const unsigned char* p = (const unsigned char*) buf.data();
+        const unsigned char* end = p + length;
+        unsigned long long n, e, a, x, s;
+        long long v;
+        
+        if (get_fixed(p, 8) != cf.hash)
+            return false;
+        p += 8;
+        
+        // The whole canonical form is compared, so that a hash collision is not a hit.
+        if (!get_varint(p, end, n) || (n != (unsigned long long) cf.num_of_vertices))
+            return false;
+        if (!get_varint(p, end, e) || (e != cf.edges.size()))
+            return false;
+        for (auto& edge : cf.edges){
+            if (!get_varint(p, end, a) || (a != edge.size()))
+                return false;
+            for (int y : edge)
+                if (!get_varint(p, end, x) || (x != (unsigned long long) y))
+                    return false;
+        }
+        
+        if (!get_varint(p, end, s))
+            return false;
+        ai_canon.clear();
+        for (unsigned long long k = 0; k < s; k++){
+            if (!get_zigzag(p, end, v))
+                return false;
+            ai_canon.push_back(v);
+        }
+        
+        return true;
+    };
+    
+    // Rebuilds the index from the log, and rewrites the index file.
+    void rebuild_index(){
+        unsigned long long offset = CACHE_HEADER_SIZE;
+        unsigned char head[12];
+        string buf;
+        
+        index.clear();
+        while (pread(log_fd, head, 12, offset) == 12){
+            unsigned long long length = get_fixed(head, 4);
+            if ((length < 8) || (offset + 4 + length > log_size))
+                break;
+            index.insert(make_pair(get_fixed(head + 4, 8), offset));
+            put_fixed(buf, get_fixed(head + 4, 8), 8);
+            put_fixed(buf, offset, 8);
+            offset += 4 + length;
+        }
+        
+        // Anything after the last complete record is cut away.
+        if (offset < log_size){
+            if (ftruncate(log_fd, offset) == 0)
+                log_size = offset;
+        }
+        
+        index_size = buf.size();
+        if ((ftruncate(index_fd, 0) != 0) || (pwrite(index_fd, buf.data(), buf.size(), 0) != (ssize_t) buf.size()))
+            cerr << "Warning: cannot rewrite the cache index" << endl;
+    };
+
+public:
+    ResultCache(){
+    };
+    
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+    
+    ~ResultCache(){
+        if (log_fd >= 0)
+            close(log_fd);
+        if (index_fd >= 0)
+            close(index_fd);
+    };
+    
+    // Opens the cache, creating it if it does not exist. Returns false, with error set, if the
+    // files cannot be opened or the log is not a cache.
+    bool open(string file_name, string& error){
+        log_fd = ::open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+        index_fd = ::open((file_name + ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+        if ((log_fd < 0) || (index_fd < 0)){
+            error = "cannot open the cache " + file_name;
+            return false;
+        }
+        
+        struct stat st;
+        fstat(log_fd, &st);
+        log_size = st.st_size;
+        
+        if (log_size == 0){
+            string header(CACHE_MAGIC, 4);
+            put_fixed(header, CACHE_VERSION, 4);
+            if (pwrite(log_fd, header.data(), header.size(), 0) != (ssize_t) header.size()){
+                error = "cannot write the cache " + file_name;
+                return false;
+            }
+            log_size = header.size();
+        }
+        else{
+            unsigned char header[CACHE_HEADER_SIZE];
+            if ((pread(log_fd, header, CACHE_HEADER_SIZE, 0) != CACHE_HEADER_SIZE) ||
+                (memcmp(header, CACHE_MAGIC, 4) != 0) || (get_fixed(header + 4, 4) != CACHE_VERSION)){
+                error = file_name + " is not a result cache of this version";
+                return false;
+            }
+        }
+        
+        // The index is trusted if every entry points inside the log and the last one ends it.
+        fstat(index_fd, &st);
+        index_size = st.st_size;
+        string buf(index_size, '\0');
+        bool valid = (index_size % 16 == 0) &&
+                     ((unsigned long long) pread(index_fd, &buf[0], index_size, 0) == index_size);
+        unsigned long long end = CACHE_HEADER_SIZE;
+        
+        for (unsigned long long k = 0; valid && (k < index_size); k += 16){
+            unsigned long long offset = get_fixed((const unsigned char*) buf.data() + k + 8, 8);
+            unsigned char head[4];
+            if ((offset != end) || (pread(log_fd, head, 4, offset) != 4))
+                valid = false;
+            else{
+                end = offset + 4 + get_fixed(head, 4);
+                index.insert(make_pair(get_fixed((const unsigned char*) buf.data() + k, 8), offset));
+            }
+        }
+        
+        if (!valid || (end != log_size))
+            this->rebuild_index();
+        
+        return true;
+    };
+    
+    // Number of records.
+    long long size(){
+        long long s;
+        
+        #pragma omp critical(result_cache)
+        s = index.size();
+        return s;
+    };
+    
+    // Looks up the ai list of a Hypergraph with canonical form cf. Safe to call from several threads.
+    // A record that runs past the end of the log is a miss.
+    bool lookup(const CanonicalForm& cf, vector<int>& ai_canon){
+        vector<unsigned long long> offsets;
+        unsigned long long end_of_log;
+        
+        #pragma omp critical(result_cache)
+        {
+            auto range = index.equal_range(cf.hash);
+            for (auto it = range.first; it != range.second; it++)
+                offsets.push_back(it->second);
+            end_of_log = log_size;
+        }
+        
+        for (auto offset : offsets)
+            if (this->read_record(offset, end_of_log, cf, ai_canon))
+                return true;
+        
+        return false;
+    };
+    
+    // Appends the ai list of a Hypergraph with canonical form cf, unless it is already there
+    // (e.g. computed by another thread meanwhile). Safe to call from several threads. The index
+    // entry is written at the end of the index file, whose offset is kept in index_size since
+    // the index file is only accessed with pread and pwrite.
+    void store(const CanonicalForm& cf, const vector<int>& ai_canon){
+        vector<int> present;
+        if (this->lookup(cf, present))
+            return;
+        
+        string payload = this->encode(cf, ai_canon);
+        string record;
+        string entry;
+        
+        put_fixed(record, payload.size(), 4);
+        record += payload;
+        
+        #pragma omp critical(result_cache)
+        {
+            if (pwrite(log_fd, record.data(), record.size(), log_size) == (ssize_t) record.size()){
+                put_fixed(entry, cf.hash, 8);
+                put_fixed(entry, log_size, 8);
+                if (pwrite(index_fd, entry.data(), entry.size(), index_size) == (ssize_t) entry.size())
+                    index_size += entry.size();
+                else
+                    cerr << "Warning: cannot write the cache index" << endl;
+                index.insert(make_pair(cf.hash, log_size));
+                log_size += record.size();
+            }
+        }
+    };
+    
+    // Absolute indifferences of hg, as absolute_indifferences(hg, stats), taken from the cache if
+    // an isomorphic Hypergraph is there. Otherwise they are computed and stored.
+    vector<int> absolute_indifferences(const Hypergraph& hg, VarietyStats& stats){
+        CanonicalForm cf = hg.canonical_form();
+        vector<int> ai_canon;
+        
+        // A Hypergraph without a canonical form is computed every time.
+        if (!cf.found){
+            num_of_not_canonical++;
+            return ::absolute_indifferences(hg, stats);
+        }
+        
+        if (this->lookup(cf, ai_canon)){
+            num_of_hits++;
+            for (int a : ai_canon)
+                if (a == 0)
+                    stats.leibnizian = false;
+            return ai_from_canonical(ai_canon, cf.labeling);
+        }
+        
+        num_of_misses++;
+        vector<int> ai = ::absolute_indifferences(hg, stats);
+        this->store(cf, ai_to_canonical(ai, cf.labeling));
+        return ai;
+    };
+    
+    // Same, but done(ai) is called with the ai list instead of it being returned. If a Hypergraph
+    // isomorphic to hg is being computed meanwhile, by another task of the same batch, hg is not
+    // computed again: done is called by that task once the ai list is known, which may be after
+    // this function has returned. stats and the arguments of done must stay alive until then.
+    // Nothing here blocks, so the tasks of a batch cannot wait on each other in a cycle.
+    template <class Done>
+    void absolute_indifferences(const Hypergraph& hg, VarietyStats& stats, Done done){
+        CanonicalForm cf = hg.canonical_form();
+        vector<int> ai_canon;
+        
+        if (!cf.found){
+            num_of_not_canonical++;
+            done(::absolute_indifferences(hg, stats));
+            return;
+        }
+        
+        if (this->lookup(cf, ai_canon)){
+            num_of_hits++;
+            for (int a : ai_canon)
+                if (a == 0)
+                    stats.leibnizian = false;
+            done(ai_from_canonical(ai_canon, cf.labeling));
+            return;
+        }
+        
+        shared_ptr<InFlight> entry;
+        bool waiting = false;
+        
+        #pragma omp critical(result_cache)
+        {
+            auto range = in_flight.equal_range(cf.hash);
+            for (auto it = range.first; !waiting && (it != range.second); it++){
+                CanonicalForm& other = it->second->cf;
+                if ((other.num_of_vertices == cf.num_of_vertices) && (other.edges == cf.edges)){
+                    vector<int> labeling = cf.labeling;
+                    VarietyStats* st = &stats;
+                    it->second->waiters.push_back([st, labeling, done](const vector<int>& ai_canon){
+                        for (int a : ai_canon)
+                            if (a == 0)
+                                st->leibnizian = false;
+                        done(ai_from_canonical(ai_canon, labeling));
+                    });
+                    waiting = true;
+                }
+            }
+            
+            if (!waiting){
+                entry = make_shared<InFlight>();
+                entry->cf = cf;
+                in_flight.insert(make_pair(cf.hash, entry));
+            }
+        }
+        
+        if (waiting){
+            num_of_shared++;
+            return;
+        }
+        
+        num_of_misses++;
+        vector<int> ai = ::absolute_indifferences(hg, stats);
+        ai_canon = ai_to_canonical(ai, cf.labeling);
+        this->store(cf, ai_canon);
+        
+        // No waiter can be added once the entry is gone. The ai list is stored by then, so only a
+        // Hypergraph that missed the lookup just before can still be computed again.
+        vector<function<void(const vector<int>&)> > waiters;
+        #pragma omp critical(result_cache)
+        {
+            auto range = in_flight.equal_range(cf.hash);
+            for (auto it = range.first; it != range.second; it++)
+                if (it->second == entry){
+                    in_flight.erase(it);
+                    break;
+                }
+            waiters.swap(entry->waiters);
+        }
+        
+        done(ai);
+        for (auto& w : waiters)
+            w(ai_canon);
+    };
+    
+    string stats_str(){
+        string str = "";
+        long long reused = num_of_hits + num_of_shared;
+        long long looked_up = reused + num_of_misses;
+        
+        str += "cache records: " + to_string(this->size());
+        str += ", hits: " + to_string(num_of_hits.load());
+        str += ", shared within the batch: " + to_string(num_of_shared.load());
+        str += ", misses: " + to_string(num_of_misses.load());
+        str += ", not canonicalized: " + to_string(num_of_not_canonical.load());
+        str += ", hit rate: " + to_string(looked_up > 0 ? (100 * reused / looked_up) : 0) + "%";
+        
+        return str;
+    };
+};
+
+#endif
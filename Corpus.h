@@ -0,0 +1,435 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <cstdio>
+#include <fstream>
+#include "Input.h"
+
+// BINARY CORPUS FORMAT (version 1)
+// A corpus is a batch of Hypergraphs, optionally with the list of ai values of each.
+// All fixed-size integers are little endian.
+//
+//   header:  "WMVC", u32 version, u32 flags (bit 0: the ai lists are present), u32 zero
+//   records: for each Hypergraph, the number of Hyperedges, then for each Hyperedge its arity
+//            and its vertices; if the ai lists are present, each record is followed by the
+//            number of ai values and the values. Counts are unsigned varints (LEB128), vertices
+//            and ai values are zigzag varints.
+//   index:   u64 offsets[n+1] of the Hypergraph records (offsets[n] is where the index begins),
+//            then, if the ai lists are present, u64 offsets[n] of the ai records.
+//   footer:  u64 n, u64 offset of the index, "CVMW", u32 zero
+//
+// The index gives random access to any Hypergraph, so a corpus can be split among jobs
+// without reading it through.
+
+const char CORPUS_MAGIC[4] = {'W', 'M', 'V', 'C'};
+const char CORPUS_END_MAGIC[4] = {'C', 'V', 'M', 'W'};
+const unsigned int CORPUS_VERSION = 1;
+const unsigned int CORPUS_HAS_AI = 1;
+const int CORPUS_HEADER_SIZE = 16;
+const int CORPUS_FOOTER_SIZE = 24;
+
+void put_varint(string& buf, unsigned long long x){
+    while (x >= 0x80){
+        buf += (char) ((x & 0x7f) | 0x80);
+        x >>= 7;
+    }
+    buf += (char) x;
+}
+
+void put_zigzag(string& buf, long long x){
+    put_varint(buf, ((unsigned long long) x << 1) ^ (unsigned long long) (x >> 63));
+}
+
+void put_fixed(string& buf, unsigned long long x, int bytes){
+    for (int i = 0; i < bytes; i++)
+        buf += (char) ((x >> (8*i)) & 0xff);
+}
+
+// Reads a varint at p, not beyond end. Returns false if it is cut or too long.
+bool get_varint(const unsigned char*& p, const unsigned char* end, unsigned long long& x){
+    x = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+        if (p == end)
+            return false;
+        unsigned char b = *p++;
+        x |= (unsigned long long) (b & 0x7f) << shift;
+        if (b < 0x80)
+            return true;
+    }
+    return false;
+}
+
+bool get_zigzag(const unsigned char*& p, const unsigned char* end, long long& x){
+    unsigned long long u;
+    
+    if (!get_varint(p, end, u))
+        return false;
+    x = (long long) (u >> 1) ^ -(long long) (u & 1);
+    return true;
+}
+
+unsigned long long get_fixed(const unsigned char* p, int bytes){
+    unsigned long long x = 0;
+    
+    for (int i = 0; i < bytes; i++)
+        x |= (unsigned long long) p[i] << (8*i);
+    return x;
+}
+
+// Writes a corpus record by record. The index is kept in memory and written by close().
+class CorpusWriter{
+
+private:
+    ofstream file;
+    bool has_ai = false;
+    unsigned long long position = 0;
+    vector<unsigned long long> hg_offsets;
+    vector<unsigned long long> ai_offsets;
+    string buf;
+    
+    void write_buf(){
+        file.write(buf.data(), buf.size());
+        position += buf.size();
+        buf.clear();
+    };
+
+public:
+    // Returns false if the file cannot be created.
+    bool open(string file_name, bool with_ai){
+        file.open(file_name, ios::binary);
+        if (!file)
+            return false;
+        
+        has_ai = with_ai;
+        buf.append(CORPUS_MAGIC, 4);
+        put_fixed(buf, CORPUS_VERSION, 4);
+        put_fixed(buf, has_ai ? CORPUS_HAS_AI : 0, 4);
+        put_fixed(buf, 0, 4);
+        this->write_buf();
+        
+        return true;
+    };
+    
+    // Appends a Hypergraph in the flat form of parse_hypergraph, and its ai values if the
+    // corpus has them.
+    void add(const vector<int>& vertices, const vector<int>& offsets, const vector<int>& ai = vector<int>()){
+        const int e = offsets.size() - 1;
+        
+        hg_offsets.push_back(position);
+        put_varint(buf, e);
+        for (int i = 0; i < e; i++){
+            put_varint(buf, offsets[i+1] - offsets[i]);
+            for (int j = offsets[i]; j < offsets[i+1]; j++)
+                put_zigzag(buf, vertices[j]);
+        }
+        this->write_buf();
+        
+        if (has_ai){
+            ai_offsets.push_back(position);
+            put_varint(buf, ai.size());
+            for (int a : ai)
+                put_zigzag(buf, a);
+            this->write_buf();
+        }
+    };
+    
+    // Writes the index and the footer. Returns false if any write, or closing the file, failed.
+    bool close(){
+        const unsigned long long n = hg_offsets.size();
+        const unsigned long long index_offset = position;
+        
+        for (auto o : hg_offsets)
+            put_fixed(buf, o, 8);
+        put_fixed(buf, index_offset, 8);
+        if (has_ai)
+            for (auto o : ai_offsets)
+                put_fixed(buf, o, 8);
+        
+        put_fixed(buf, n, 8);
+        put_fixed(buf, index_offset, 8);
+        buf.append(CORPUS_END_MAGIC, 4);
+        put_fixed(buf, 0, 4);
+        this->write_buf();
+        if (!file.good())
+            return false;
+        
+        file.close();
+        return file.good();
+    };
+    
+    // Closes the file without the index and the footer, for a corpus that is given up.
+    void abandon(){
+        file.close();
+    };
+};
+
+// Returns true if the file begins like a corpus.
+bool is_corpus_file(MappedFile& file){
+    return (file.size() >= CORPUS_HEADER_SIZE) && (memcmp(file.begin(), CORPUS_MAGIC, 4) == 0);
+}
+
+// Reads Hypergraphs from a memory-mapped corpus, in any order.
+class CorpusReader{
+
+private:
+    const unsigned char* data = nullptr;
+    unsigned long long length = 0;
+    unsigned long long n = 0;
+    unsigned long long index_offset = 0;
+    bool has_ai_lists = false;
+    
+    unsigned long long hg_offset(unsigned long long i){
+        return get_fixed(data + index_offset + 8*i, 8);
+    };
+    
+    unsigned long long ai_offset(unsigned long long i){
+        return get_fixed(data + index_offset + 8*(n+1) + 8*i, 8);
+    };
+
+public:
+    // Checks the header, the footer and the index. Returns false, with error set, if the
+    // file is not a valid corpus.
+    bool open(MappedFile& file, string& error){
+        data = (const unsigned char*) file.begin();
+        length = file.size();
+        
+        if (!is_corpus_file(file) || (length < CORPUS_HEADER_SIZE + CORPUS_FOOTER_SIZE)){
+            error = "not a hypergraph corpus";
+            return false;
+        }
+        
+        unsigned long long version = get_fixed(data + 4, 4);
+        if (version != CORPUS_VERSION){
+            error = "unsupported corpus version " + to_string(version);
+            return false;
+        }
+        has_ai_lists = (get_fixed(data + 8, 4) & CORPUS_HAS_AI) != 0;
+        
+        const unsigned char* footer = data + length - CORPUS_FOOTER_SIZE;
+        n = get_fixed(footer, 8);
+        index_offset = get_fixed(footer + 8, 8);
+        
+        // n is checked against the room left for the index before the size of the index is
+        // computed, which could overflow otherwise.
+        bool valid = (memcmp(footer + 16, CORPUS_END_MAGIC, 4) == 0) && (index_offset >= CORPUS_HEADER_SIZE) &&
+                     (index_offset <= length - CORPUS_FOOTER_SIZE);
+        if (valid){
+            unsigned long long index_words = (length - CORPUS_FOOTER_SIZE - index_offset) / 8;
+            valid = (n < index_words) && (!has_ai_lists || (n <= (index_words - 1) / 2));
+        }
+        
+        if (!valid || (hg_offset(n) != index_offset)){
+            error = "corrupted corpus index";
+            return false;
+        }
+        
+        for (unsigned long long i = 0; i < n; i++)
+            if ((hg_offset(i) < CORPUS_HEADER_SIZE) || (hg_offset(i) > hg_offset(i+1)) ||
+                (has_ai_lists && ((ai_offset(i) < hg_offset(i)) || (ai_offset(i) > hg_offset(i+1))))){
+                error = "corrupted corpus index";
+                return false;
+            }
+        
+        return true;
+    };
+    
+    // Number of Hypergraphs.
+    long long size(){
+        return n;
+    };
+    
+    bool has_ai(){
+        return has_ai_lists;
+    };
+    
+    // Reads Hypergraph i in the flat form of parse_hypergraph. Returns false if the record is corrupted.
+    bool read(long long i, vector<int>& vertices, vector<int>& offsets){
+        const unsigned char* p = data + hg_offset(i);
+        const unsigned char* end = data + (has_ai_lists ? ai_offset(i) : hg_offset(i+1));
+        unsigned long long e, a;
+        long long v;
+        
+        vertices.clear();
+        offsets.assign(1, 0);
+        
+        if (!get_varint(p, end, e))
+            return false;
+        for (unsigned long long k = 0; k < e; k++){
+            if (!get_varint(p, end, a))
+                return false;
+            for (unsigned long long j = 0; j < a; j++){
+                if (!get_zigzag(p, end, v) || (v < INT_MIN) || (v > INT_MAX))
+                    return false;
+                vertices.push_back(v);
+            }
+            offsets.push_back(vertices.size());
+        }
+        
+        return true;
+    };
+    
+    bool read(long long i, Hypergraph& hg){
+        static thread_local vector<int> vertices;
+        static thread_local vector<int> offsets;
+        
+        if (!this->read(i, vertices, offsets))
+            return false;
+        hg.assign(vertices, offsets);
+        return true;
+    };
+    
+    // Reads the ai values of Hypergraph i. Returns false if there are none or the record is corrupted.
+    bool read_ai(long long i, vector<int>& ai){
+        ai.clear();
+        if (!has_ai_lists)
+            return false;
+        
+        const unsigned char* p = data + ai_offset(i);
+        const unsigned char* end = data + hg_offset(i+1);
+        unsigned long long s;
+        long long a;
+        
+        if (!get_varint(p, end, s))
+            return false;
+        for (unsigned long long k = 0; k < s; k++){
+            if (!get_zigzag(p, end, a) || (a < INT_MIN) || (a > INT_MAX))
+                return false;
+            ai.push_back(a);
+        }
+        
+        return true;
+    };
+};
+
+// Converts a text file (one Hypergraph per line, optionally followed by ";" and its ai list,
+// as in the output of wmvar) to a corpus. The ai lists are kept if the first line has one; then
+// every line must have one, and otherwise none may. Returns false, with error set, at the first
+// malformed line, or the first line that breaks this rule. The corpus is written to a temporary
+// file that is renamed only once it is complete, so a failed conversion leaves nothing behind.
+bool text_to_corpus(string text_file_name, string corpus_file_name, string& error){
+    MappedFile file;
+    CorpusWriter corpus;
+    vector<int> vertices, offsets, ai;
+    const char* error_pos;
+    const char* error_msg;
+    InputLine line;
+    const string temp_file_name = corpus_file_name + ".tmp";
+    bool first = true;
+    bool with_ai = false;
+    
+    if (!file.open(text_file_name)){
+        error = "cannot open " + text_file_name;
+        return false;
+    }
+    
+    error.clear();
+    LineReader lines(file.begin(), file.end());
+    while (lines.next(line)){
+        const char* semicolon = (const char*) memchr(line.begin, ';', line.end - line.begin);
+        const char* hg_end = (semicolon != nullptr) ? semicolon : line.end;
+        
+        if (first){
+            with_ai = (semicolon != nullptr);
+            if (!corpus.open(temp_file_name, with_ai)){
+                error = "cannot create " + temp_file_name;
+                break;
+            }
+            first = false;
+        }
+        else if ((semicolon != nullptr) != with_ai){
+            error = text_file_name + ":" + to_string(line.number) + ": error: " +
+                    (with_ai ? "no ai list, but the first line has one" : "an ai list, but the first line has none");
+            break;
+        }
+        
+        vertices.clear();
+        offsets.assign(1, 0);
+        if (!parse_hypergraph(line.begin, hg_end, vertices, offsets, error_pos, error_msg)){
+            error = text_file_name + ":" + to_string(line.number) + ":" + to_string(error_pos - line.begin + 1) +
+                    ": error: " + error_msg;
+            break;
+        }
+        
+        ai.clear();
+        if ((semicolon != nullptr) && !parse_int_list(semicolon + 1, line.end, ai)){
+            error = text_file_name + ":" + to_string(line.number) + ": error: malformed ai list";
+            break;
+        }
+        
+        corpus.add(vertices, offsets, ai);
+    }
+    
+    if (first && error.empty() && !corpus.open(temp_file_name, false))
+        error = "cannot create " + temp_file_name;
+    if (!error.empty()){
+        corpus.abandon();
+        remove(temp_file_name.c_str());
+        return false;
+    }
+    if (!corpus.close()){
+        error = "cannot write " + temp_file_name;
+        remove(temp_file_name.c_str());
+        return false;
+    }
+    if (rename(temp_file_name.c_str(), corpus_file_name.c_str()) != 0){
+        error = "cannot rename " + temp_file_name + " to " + corpus_file_name;
+        remove(temp_file_name.c_str());
+        return false;
+    }
+    
+    return true;
+}
+
+// Converts a corpus back to text, with the ai lists if it has them.
+bool corpus_to_text(string corpus_file_name, string text_file_name, string& error){
+    MappedFile file;
+    CorpusReader corpus;
+    Hypergraph hg;
+    vector<int> ai;
+    
+    if (!file.open(corpus_file_name)){
+        error = "cannot open " + corpus_file_name;
+        return false;
+    }
+    if (!corpus.open(file, error)){
+        error = corpus_file_name + ": " + error;
+        return false;
+    }
+    
+    ofstream out(text_file_name);
+    for (long long i = 0; i < corpus.size(); i++){
+        if (!corpus.read(i, hg)){
+            error = corpus_file_name + ": corrupted record " + to_string(i);
+            return false;
+        }
+        out << hg.str();
+        if (corpus.has_ai()){
+            corpus.read_ai(i, ai);
+            out << ";" << vec_str(ai);
+        }
+        out << "\n";
+    }
+    
+    return true;
+}
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <climits>
+#include "Structures.h"
+
+// A whole file mapped into memory, read only. Lines are parsed where they lie in the file,
+// so nothing is copied.
+class MappedFile{
+    
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    
+public:
+    MappedFile(){
+    };
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    ~MappedFile(){
+        if (length > 0)
+            munmap((void*) data, length);
+    };
+    
+    // Returns false if the file cannot be opened or mapped.
+    bool open(string file_name){
+        int fd = ::open(file_name.c_str(), O_RDONLY);
+        struct stat st;
+        
+        if (fd < 0)
+            return false;
+        
+        if (fstat(fd, &st) < 0){
+            close(fd);
+            return false;
+        }
+        
+        length = st.st_size;
+        if (length > 0){
+            void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED){
+                length = 0;
+                close(fd);
+                return false;
+            }
+            data = (const char*) p;
+            madvise(p, length, MADV_SEQUENTIAL);
+        }
+        
+        close(fd);
+        return true;
+    };
+    
+    const char* begin(){
+        return data;
+    };
+    
+    const char* end(){
+        return data + length;
+    };
+    
+    size_t size(){
+        return length;
+    };
+};
+
+// A line of the input, without its newline. number starts from 1.
+struct InputLine{
+    const char* begin;
+    const char* end;
+    long long number;
+};
+
+// Splits [begin, end) into lines. Lines with nothing but whitespace are skipped.
+class LineReader{
+    
+private:
+    const char* p;
+    const char* stop;
+    long long number = 0;
+    
+public:
+    LineReader(const char* begin, const char* end){
+        p = begin;
+        stop = end;
+    };
+    
+    bool next(InputLine& line){
+        while (p < stop){
+            const char* q = (const char*) memchr(p, '\n', stop - p);
+            if (q == nullptr)
+                q = stop;
+            
+            line.begin = p;
+            line.end = q;
+            line.number = ++number;
+            p = (q < stop) ? q + 1 : stop;
+            
+            // Files written on Windows end their lines with "\r\n".
+            if ((line.end > line.begin) && (line.end[-1] == '\r'))
+                line.end--;
+            
+            for (const char* c = line.begin; c < line.end; c++)
+                if ((*c != ' ') && (*c != '\t') && (*c != '\r'))
+                    return true;
+        }
+        
+        return false;
+    };
+};
+
+// Parses a list of integers written as {1,2,3} in [begin, end), such as an ai list.
+bool parse_int_list(const char* begin, const char* end, vector<int>& values){
+    const char* p = begin;
+    
+    auto skip_spaces = [&](){
+        while ((p < end) && ((*p == ' ') || (*p == '\t')))
+            p++;
+    };
+    
+    values.clear();
+    skip_spaces();
+    if ((p == end) || (*p != '{'))
+        return false;
+    p++;
+    skip_spaces();
+    
+    while ((p < end) && (*p != '}')){
+        if (!values.empty()){
+            if (*p != ',')
+                return false;
+            p++;
+            skip_spaces();
+        }
+        
+        // The text may not end with a null character, so we do not use strtol.
+        bool negative = false;
+        if ((p < end) && (*p == '-')){
+            negative = true;
+            p++;
+        }
+        if ((p == end) || (*p < '0') || (*p > '9'))
+            return false;
+        
+        long long v = 0;
+        while ((p < end) && (*p >= '0') && (*p <= '9')){
+            v = 10*v + (*p - '0');
+            if (v > INT_MAX)
+                return false;
+            p++;
+        }
+        values.push_back(negative ? -v : v);
+        skip_spaces();
+    }
+    
+    if (p == end)
+        return false;
+    p++;
+    skip_spaces();
+    
+    return p == end;
+}
+
+// Parses a line into hg. The flat buffers are kept per thread and reused, so the parser itself
+// does not allocate. On malformed input, error is set to "source:line:column: error: ..."
+// and false is returned.
+bool parse_line(const InputLine& line, string source, Hypergraph& hg, string& error){
+    static thread_local vector<int> vertices;
+    static thread_local vector<int> offsets;
+    const char* error_pos;
+    const char* error_msg;
+    
+    vertices.clear();
+    offsets.assign(1, 0);
+    
+    if (!parse_hypergraph(line.begin, line.end, vertices, offsets, error_pos, error_msg)){
+        error = source + ":" + to_string(line.number) + ":" + to_string(error_pos - line.begin + 1) +
+                ": error: " + error_msg;
+        return false;
+    }
+    
+    hg.assign(vertices, offsets);
+    return true;
+}
+
+#endif
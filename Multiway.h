@@ -0,0 +1,379 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ 
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#ifndef MULTIWAY_H
+#define MULTIWAY_H
+
+#include <deque>
+#include "Variety.h"
+#include "Cache.h"
+
+// MULTIWAY EVOLUTION
+// A Wolfram model rule such as {{1,2},{2,3}}->{{1,3},{2,4}} replaces Hyperedges that match the
+// left hand side by the right hand side. The Hyperedges are ordered, and the numbers of the left
+// hand side are pattern variables: a variable takes the same vertex wherever it appears, but two
+// variables may take the same vertex. A variable that appears only on the right hand side is a
+// new vertex.
+//
+// The multiway system applies every rule at every match to every state. States are kept in
+// canonical form, so that isomorphic states are one state.
+
+struct WolframRule{
+    vector<vector<int> > lhs;
+    vector<vector<int> > rhs;
+    
+    // Pattern variables are renumbered 0, 1, ...; the ones of the left hand side come first.
+    int num_of_lhs_variables = 0;
+    int num_of_variables = 0;
+};
+
+// Parses rules separated by ';', e.g. "{{1,2}}->{{1,3},{3,2}};{{1,1}}->{{1}}".
+// Returns false, with error set, if some rule is malformed.
+bool parse_rules(string str, vector<WolframRule>& rules, string& error){
+    size_t begin = 0;
+    
+    while (begin < str.size()){
+        size_t end = str.find(';', begin);
+        if (end == string::npos)
+            end = str.size();
+        
+        string text = str.substr(begin, end - begin);
+        size_t arrow = text.find("->");
+        if (arrow == string::npos){
+            error = "rule '" + text + "': expected '->'";
+            return false;
+        }
+        
+        WolframRule rule;
+        vector<vector<vector<int> >* > sides = {&rule.lhs, &rule.rhs};
+        const char* side_begin[2] = {text.data(), text.data() + arrow + 2};
+        const char* side_end[2] = {text.data() + arrow, text.data() + text.size()};
+        map<int, int> variables;
+        
+        for (int k = 0; k < 2; k++){
+            vector<int> vertices;
+            vector<int> offsets(1, 0);
+            const char* error_pos;
+            const char* error_msg;
+            
+            if (!parse_hypergraph(side_begin[k], side_end[k], vertices, offsets, error_pos, error_msg)){
+                error = "rule '" + text + "': " + error_msg;
+                return false;
+            }
+            
+            for (int i = 0; i + 1 < (int) offsets.size(); i++){
+                vector<int> e;
+                for (int j = offsets[i]; j < offsets[i+1]; j++){
+                    if (variables.find(vertices[j]) == variables.end()){
+                        int x = variables.size();
+                        variables[vertices[j]] = x;
+                    }
+                    e.push_back(variables[vertices[j]]);
+                }
+                sides[k]->push_back(e);
+            }
+            
+            if (k == 0)
+                rule.num_of_lhs_variables = variables.size();
+        }
+        
+        if (rule.lhs.empty()){
+            error = "rule '" + text + "': empty left hand side";
+            return false;
+        }
+        rule.num_of_variables = variables.size();
+        rules.push_back(rule);
+        
+        begin = end + 1;
+    }
+    
+    if (rules.empty()){
+        error = "no rules given";
+        return false;
+    }
+    
+    return true;
+}
+
+// Calls found(matched, binding) for each match of the left hand side of rule in state, from
+// Hyperedge k of the pattern on. matched[i] is the index of the Hyperedge of state that
+// matches the i-th Hyperedge of the pattern, binding[x] the vertex of variable x (-1 if free).
+template <class Found>
+void match_rule(const vector<vector<int> >& state, const WolframRule& rule, int k,
+                vector<int>& matched, vector<int>& binding, Found& found){
+    if (k == (int) rule.lhs.size()){
+        found(matched, binding);
+        return;
+    }
+    
+    const vector<int>& pattern = rule.lhs[k];
+    
+    for (int i = 0; i < (int) state.size(); i++){
+        if ((state[i].size() != pattern.size()) || (find(matched.begin(), matched.begin() + k, i) != matched.begin() + k))
+            continue;
+        
+        // The variables bound here are freed again afterwards.
+        vector<int> bound;
+        bool ok = true;
+        for (int j = 0; ok && (j < (int) pattern.size()); j++){
+            int x = pattern[j];
+            if (binding[x] < 0){
+                binding[x] = state[i][j];
+                bound.push_back(x);
+            }
+            else if (binding[x] != state[i][j])
+                ok = false;
+        }
+        
+        if (ok){
+            matched[k] = i;
+            match_rule(state, rule, k+1, matched, binding, found);
+        }
+        
+        for (int x : bound)
+            binding[x] = -1;
+    }
+}
+
+// The form a state is kept in: its canonical form. A state so symmetric that it has no canonical
+// form within the search budget keeps its own labels (renumbered 0, ..., n-1); it may then not be
+// merged with some isomorphic state.
+CanonicalForm form_of_state(const Hypergraph& hg){
+    CanonicalForm cf = hg.canonical_form();
+    
+    if (!cf.found){
+        vector<int> uv = hg.unique_vertices().get_vertices();
+        cf.num_of_vertices = uv.size();
+        cf.edges.clear();
+        for (int i = 0; i < hg.size(); i++){
+            vector<int> e;
+            for (int u : hg.get(i).get_vertices())
+                e.push_back(lower_bound(uv.begin(), uv.end(), u) - uv.begin());
+            cf.edges.push_back(e);
+        }
+        cf.hash = hash_of_edges(cf.edges, cf.num_of_vertices);
+    }
+    
+    return cf;
+}
+
+// Forms of the states that follow from state, on the vertices 0, ..., n-1, by one application of
+// some rule, see form_of_state.
+vector<CanonicalForm> successors_of_state(const vector<vector<int> >& state, int n, const vector<WolframRule>& rules){
+    vector<CanonicalForm> successors;
+    
+    for (const WolframRule& rule : rules){
+        vector<int> matched(rule.lhs.size(), -1);
+        vector<int> binding(rule.num_of_variables, -1);
+        
+        auto found = [&](vector<int>& matched, vector<int>& binding){
+            vector<bool> removed(state.size(), false);
+            for (int i : matched)
+                removed[i] = true;
+            
+            Hypergraph next;
+            for (int i = 0; i < (int) state.size(); i++)
+                if (!removed[i])
+                    next.append(Hyperedge(state[i]));
+            
+            // New vertices are numbered after the existing ones.
+            vector<int> vertex_of = binding;
+            for (int x = rule.num_of_lhs_variables; x < rule.num_of_variables; x++)
+                vertex_of[x] = n + (x - rule.num_of_lhs_variables);
+            for (auto& pattern : rule.rhs){
+                vector<int> e;
+                for (int x : pattern)
+                    e.push_back(vertex_of[x]);
+                next.append(Hyperedge(e));
+            }
+            
+            successors.push_back(form_of_state(next));
+        };
+        
+        match_rule(state, rule, 0, matched, binding, found);
+    }
+    
+    return successors;
+}
+
+// A state of the multiway system and the result computed for it.
+struct MultiwayState{
+    long long id;
+    int generation;
+    CanonicalForm form;
+    vector<int> ais;
+    VarietyStats stats;
+    
+    // The state as a Hypergraph, with vertices 1, ..., n.
+    Hypergraph hypergraph(){
+        Hypergraph hg;
+        
+        for (auto& e : form.edges){
+            vector<int> vs;
+            for (int x : e)
+                vs.push_back(x + 1);
+            hg.append(Hyperedge(vs));
+        }
+        
+        return hg;
+    };
+};
+
+struct MultiwayCounts{
+    long long states = 0;
+    long long events = 0;
+    long long edges = 0;
+    long long non_leibnizian = 0;
+    VarietyStats stats;
+    CounterSet counters;
+};
+
+class MultiwaySystem{
+
+private:
+    vector<WolframRule> rules;
+    
+    // A deque, so that a state stays in place while the tasks that compute it run.
+    deque<MultiwayState> states;
+    unordered_multimap<unsigned long long, long long> state_of_hash;
+    
+    // Returns the id of the state with canonical form cf, adding it if it is new.
+    long long find_or_add(CanonicalForm& cf, int generation, bool& is_new){
+        auto range = state_of_hash.equal_range(cf.hash);
+        for (auto it = range.first; it != range.second; it++){
+            CanonicalForm& other = states[it->second].form;
+            if ((other.num_of_vertices == cf.num_of_vertices) && (other.edges == cf.edges)){
+                is_new = false;
+                return it->second;
+            }
+        }
+        
+        MultiwayState s;
+        s.id = states.size();
+        s.generation = generation;
+        s.form = cf;
+        states.push_back(s);
+        state_of_hash.insert(make_pair(cf.hash, s.id));
+        is_new = true;
+        
+        return s.id;
+    };
+
+public:
+    MultiwaySystem(vector<WolframRule> rs){
+        rules = rs;
+    };
+    
+    // Expands the multiway system from init for the given number of generations. Each new state
+    // gets its ai list (from cache if given) in a task of its own, while the next generation is
+    // expanded. States are written to states_out as "id;generation;hypergraph;ais" lines, and the
+    // edges of the state graph to edges_out as "from;to" lines, generation by generation.
+    void evolve(const Hypergraph& init, int generations, ostream& states_out, ostream& edges_out,
+                ResultCache* cache, MultiwayCounts& counts){
+        char writer;
+        
+        run_tasks([&](){
+            CounterScope scope(&counts.counters);
+            vector<long long> frontier;
+            
+            // Computes the ai list of a new state and writes it out, in the order of the ids.
+            auto spawn_state = [&](long long id){
+                MultiwayState* s = &states[id];
+                
+                #pragma omp task default(shared) firstprivate(s) depend(inout: s[0])
+                {
+                    CounterScope scope(&counts.counters);
+                    Hypergraph hg = s->hypergraph();
+                    s->ais = (cache != nullptr) ? cache->absolute_indifferences(hg, s->stats)
+                                                : absolute_indifferences(hg, s->stats);
+                }
+                
+                #pragma omp task default(shared) firstprivate(s) depend(in: s[0]) depend(inout: writer)
+                {
+                    CounterScope scope(&counts.counters);
+                    states_out << s->id << ";" << s->generation << ";" << s->hypergraph().str() << ";"
+                               << vec_str(s->ais) << "\n";
+                    counts.states++;
+                    counts.stats.add(s->stats);
+                    if (!s->stats.leibnizian)
+                        counts.non_leibnizian++;
+                }
+            };
+            
+            CanonicalForm cf = form_of_state(init);
+            bool is_new;
+            frontier.push_back(this->find_or_add(cf, 0, is_new));
+            spawn_state(frontier[0]);
+            
+            for (int g = 1; (g <= generations) && !frontier.empty(); g++){
+                vector<vector<CanonicalForm> > successors(frontier.size());
+                
+                // The successors of the frontier are found in parallel, with the ai tasks of
+                // earlier generations running alongside.
+                #pragma omp taskloop grainsize(1) default(shared)
+                for (int i = 0; i < (int) frontier.size(); i++){
+                    CounterScope scope(&counts.counters);
+                    MultiwayState& s = states[frontier[i]];
+                    successors[i] = successors_of_state(s.form.edges, s.form.num_of_vertices, rules);
+                }
+                
+                // The states are numbered in a fixed order, whatever the number of threads.
+                vector<long long> next_frontier;
+                vector<pair<long long, long long> > edges;
+                for (int i = 0; i < (int) frontier.size(); i++){
+                    set<long long> targets;
+                    for (CanonicalForm& next : successors[i]){
+                        long long id = this->find_or_add(next, g, is_new);
+                        if (is_new){
+                            next_frontier.push_back(id);
+                            spawn_state(id);
+                        }
+                        if (targets.insert(id).second)
+                            edges.push_back(make_pair(frontier[i], id));
+                    }
+                    counts.events += successors[i].size();
+                }
+                
+                #pragma omp task default(shared) firstprivate(edges) depend(inout: writer)
+                {
+                    CounterScope scope(&counts.counters);
+                    for (auto& e : edges)
+                        edges_out << e.first << ";" << e.second << "\n";
+                    counts.edges += edges.size();
+                }
+                
+                frontier = next_frontier;
+            }
+            
+            #pragma omp taskwait
+        });
+    };
+};
+
+string multiway_counts_str(const MultiwayCounts& counts){
+    string str = "";
+    
+    str += "states: " + to_string(counts.states);
+    str += ", events: " + to_string(counts.events);
+    str += ", state graph edges: " + to_string(counts.edges);
+    
+    return str;
+}
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ 
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#ifndef PATHS_H
+#define PATHS_H
+
+#include <functional>
+#include "Input.h"
+
+// ACTIONS OF PATHS
+// The action of a path in the states graph is the sum of the varieties of its states, or zero
+// if some state is non-Leibnizian (ActionOfPathFromAis in Variety.wl). Instead of listing the
+// paths, which are exponentially many, the states graph is walked once in topological order and
+// each state keeps a summary of the paths that reach it.
+
+// Contribution of one ai value to the variety; the canonical choice is 1/ai.
+typedef function<double(int)> AiWeight;
+
+map<string, AiWeight> ai_weights(){
+    map<string, AiWeight> weights;
+    
+    weights["inverse"] = [](int ai){ return 1.0 / ai; };
+    weights["inverse_square"] = [](int ai){ return 1.0 / ((double) ai * ai); };
+    weights["one"] = [](int){ return 1.0; };
+    
+    return weights;
+}
+
+// VarietyFromAis in Variety.wl: zero if some ai is zero, the sum of the weights otherwise.
+double variety_from_ais(const vector<int>& ais, const AiWeight& weight){
+    double var = 0;
+    
+    for (int ai : ais){
+        if (ai == 0)
+            return 0;
+        var += weight(ai);
+    }
+    
+    return var;
+}
+
+// Summary of the paths from the source to the target of a query. Path counts are kept as
+// long double since they grow exponentially with the length.
+struct PathQuery{
+    long double num_of_paths = 0;
+    long double num_of_leibnizian_paths = 0;
+    
+    // Over the Leibnizian paths only; the other paths have zero action.
+    long double total_action = 0;
+    double min_action = 0;
+    double max_action = 0;
+    vector<long long> min_path;
+    vector<long long> max_path;
+};
+
+class StateGraph{
+
+private:
+    // States are renumbered 0, 1, ... in the order they are read; id is the number in the file.
+    vector<long long> id;
+    unordered_map<long long, int> index_of_id;
+    vector<vector<int> > ais;
+    vector<vector<int> > successors;
+    vector<vector<int> > predecessors;
+    
+    // Parses a nonnegative integer in [p, end) and moves p past it.
+    static bool parse_id(const char*& p, const char* end, long long& value){
+        if ((p == end) || (*p < '0') || (*p > '9'))
+            return false;
+        
+        value = 0;
+        while ((p < end) && (*p >= '0') && (*p <= '9'))
+            value = 10*value + (*p++ - '0');
+        return true;
+    };
+    
+    // Reads the lines of file_name one by one. Returns false, with error set, if the file
+    // cannot be read or read_line rejects some line.
+    template <class ReadLine>
+    static bool read_lines(string file_name, ReadLine read_line, string& error){
+        MappedFile file;
+        
+        if (!file.open(file_name)){
+            error = "cannot open " + file_name;
+            return false;
+        }
+        
+        LineReader lines(file.begin(), file.end());
+        InputLine line;
+        while (lines.next(line))
+            if (!read_line(line)){
+                error = file_name + ":" + to_string(line.number) + ": error: malformed line";
+                return false;
+            }
+        
+        return true;
+    };
+
+public:
+    StateGraph(){
+    };
+    
+    // Loads the output of wmvar -m: "id;generation;hypergraph;ais" lines in states_file_name
+    // and "from;to" lines in edges_file_name. Returns false, with error set, on malformed lines.
+    bool load(string states_file_name, string edges_file_name, string& error){
+        bool ok = read_lines(states_file_name, [&](InputLine& line){
+            const char* p = line.begin;
+            long long i;
+            vector<int> values;
+            
+            // The ai list is the last field.
+            const char* q = line.end;
+            while ((q > p) && (q[-1] != ';'))
+                q--;
+            if (!parse_id(p, line.end, i) || (q == line.begin) || !parse_int_list(q, line.end, values))
+                return false;
+            if (index_of_id.count(i) > 0)
+                return false;
+            
+            index_of_id[i] = id.size();
+            id.push_back(i);
+            ais.push_back(values);
+            return true;
+        }, error);
+        
+        successors.assign(id.size(), vector<int>());
+        predecessors.assign(id.size(), vector<int>());
+        
+        ok = ok && read_lines(edges_file_name, [&](InputLine& line){
+            const char* p = line.begin;
+            long long from, to;
+            
+            if (!parse_id(p, line.end, from) || (p == line.end) || (*p++ != ';') || !parse_id(p, line.end, to))
+                return false;
+            if ((index_of_id.count(from) == 0) || (index_of_id.count(to) == 0))
+                return false;
+            
+            // A state that is rewritten into itself adds nothing to the paths.
+            if (from == to)
+                return true;
+            successors[index_of_id[from]].push_back(index_of_id[to]);
+            predecessors[index_of_id[to]].push_back(index_of_id[from]);
+            return true;
+        }, error);
+        
+        return ok;
+    };
+    
+    int size(){
+        return id.size();
+    };
+    
+    bool has_state(long long i){
+        return index_of_id.count(i) > 0;
+    };
+    
+    // Summarizes the paths from the state source to the state target (given by their ids).
+    // Only the states that lie on such paths are visited. Returns false, with error set, if these
+    // states do not form a DAG.
+    bool query(long long source, long long target, const AiWeight& weight, PathQuery& result, string& error){
+        const int n = id.size();
+        int s = index_of_id[source];
+        int t = index_of_id[target];
+        
+        // States reachable from s, and states from which t is reachable.
+        Bitset from_s(n), to_t(n);
+        vector<int> stack(1, s);
+        from_s.set(s);
+        while (!stack.empty()){
+            int x = stack.back();
+            stack.pop_back();
+            for (int y : successors[x])
+                if (!from_s.test(y)){
+                    from_s.set(y);
+                    stack.push_back(y);
+                }
+        }
+        stack.assign(1, t);
+        to_t.set(t);
+        while (!stack.empty()){
+            int x = stack.back();
+            stack.pop_back();
+            for (int y : predecessors[x])
+                if (!to_t.test(y)){
+                    to_t.set(y);
+                    stack.push_back(y);
+                }
+        }
+        
+        result = PathQuery();
+        if (!from_s.test(t))
+            return true;
+        
+        // The states on the paths.
+        Bitset on_paths = from_s;
+        on_paths &= to_t;
+        const int num_of_states = on_paths.count();
+        
+        // Topological order of the states on the paths (Kahn's algorithm).
+        vector<int> in_degree(n, 0);
+        vector<int> order;
+        on_paths.for_each([&](int x){
+            for (int y : successors[x])
+                if (on_paths.test(y))
+                    in_degree[y]++;
+        });
+        if (in_degree[s] == 0)
+            order.push_back(s);
+        for (int k = 0; k < (int) order.size(); k++)
+            for (int y : successors[order[k]])
+                if (on_paths.test(y) && (--in_degree[y] == 0))
+                    order.push_back(y);
+        
+        if ((int) order.size() != num_of_states){
+            error = "the states graph has a cycle between " + to_string(source) + " and " + to_string(target);
+            return false;
+        }
+        
+        // For each state x, the same summary for the paths from s to x. The best predecessors
+        // are kept to recover the extremal paths.
+        vector<long double> paths(n, 0), leibnizian_paths(n, 0), total(n, 0);
+        vector<double> low(n, 0), high(n, 0);
+        vector<int> low_pred(n, -1), high_pred(n, -1);
+        
+        for (int x : order){
+            // As in LeibnizianPathQ, a state of zero variety, e.g. one with an empty ai list, is
+            // non-Leibnizian.
+            double var = variety_from_ais(ais[x], weight);
+            bool leibnizian = (var != 0);
+            
+            if (x == s){
+                paths[x] = 1;
+                if (leibnizian){
+                    leibnizian_paths[x] = 1;
+                    total[x] = low[x] = high[x] = var;
+                }
+                continue;
+            }
+            
+            for (int p : predecessors[x]){
+                if (!on_paths.test(p))
+                    continue;
+                
+                paths[x] += paths[p];
+                if (!leibnizian || (leibnizian_paths[p] == 0))
+                    continue;
+                
+                if ((leibnizian_paths[x] == 0) || (low[p] + var < low[x])){
+                    low[x] = low[p] + var;
+                    low_pred[x] = p;
+                }
+                if ((leibnizian_paths[x] == 0) || (high[p] + var > high[x])){
+                    high[x] = high[p] + var;
+                    high_pred[x] = p;
+                }
+                leibnizian_paths[x] += leibnizian_paths[p];
+                total[x] += total[p] + leibnizian_paths[p] * var;
+            }
+        }
+        
+        result.num_of_paths = paths[t];
+        result.num_of_leibnizian_paths = leibnizian_paths[t];
+        result.total_action = total[t];
+        if (leibnizian_paths[t] > 0){
+            result.min_action = low[t];
+            result.max_action = high[t];
+            for (int x = t; x >= 0; x = low_pred[x])
+                result.min_path.insert(result.min_path.begin(), id[x]);
+            for (int x = t; x >= 0; x = high_pred[x])
+                result.max_path.insert(result.max_path.begin(), id[x]);
+        }
+        
+        return true;
+    };
+};
+
+string path_str(const vector<long long>& path){
+    string str = "";
+    
+    for (int i = 0; i < (int) path.size(); i++)
+        str += ((i > 0) ? "," : "") + to_string(path[i]);
+    
+    return "{" + str + "}";
+}
+
+// Path counts are whole numbers as long as they fit in a long long.
+string path_count_str(long double count){
+    if (count < 1e18)
+        return to_string((long long) count);
+    return to_string((double) count);
+}
+
+string path_query_str(const PathQuery& q){
+    string str = "";
+    
+    str += "paths: " + path_count_str(q.num_of_paths);
+    str += ", Leibnizian paths: " + path_count_str(q.num_of_leibnizian_paths);
+    if (q.num_of_leibnizian_paths > 0){
+        str += ", mean action: " + to_string((double) (q.total_action / q.num_of_paths));
+        str += ", min action: " + to_string(q.min_action) + " " + path_str(q.min_path);
+        str += ", max action: " + to_string(q.max_action) + " " + path_str(q.max_path);
+    }
+    
+    return str;
+}
+
+#endif
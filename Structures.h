@@ -17,57 +17,327 @@
  Email: f.semih.dundar@yandex.com
 */
 
+#ifndef STRUCTURES_H
+#define STRUCTURES_H
+
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+#include "omp.h"
 #include <algorithm>
 #include <string>
 #include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 
 
-// Keeps a list of (frequency, {vertices})
-typedef class map<int, vector<int> > FrequencyDict;
+// Counters of the work done on the hot paths. Each thread counts into the HotCounters of the
+// Hypergraph it is working on (see CounterScope), so that counting costs a plain increment.
+// The vertex mappings of the isomorphism search take the place of the rules that were
+// enumerated and tested before: a mapping is extended one vertex at a time, and each Hyperedge
+// that becomes fully mapped is checked.
+struct alignas(64) HotCounters{
+    long long tree_nodes = 0;
+    long long max_tree_depth = 0;
+    long long neighborhood_calls = 0;
+    long long iso_calls = 0;
+    long long iso_rejected_by_hash = 0;
+    long long iso_rejected_by_shape = 0;
+    long long iso_full_checks = 0;
+    long long mappings_extended = 0;
+    long long edges_checked = 0;
+    long long allocations = 0;
+    long long bytes_allocated = 0;
+    
+    void add(const HotCounters& c){
+        tree_nodes += c.tree_nodes;
+        max_tree_depth = max(max_tree_depth, c.max_tree_depth);
+        neighborhood_calls += c.neighborhood_calls;
+        iso_calls += c.iso_calls;
+        iso_rejected_by_hash += c.iso_rejected_by_hash;
+        iso_rejected_by_shape += c.iso_rejected_by_shape;
+        iso_full_checks += c.iso_full_checks;
+        mappings_extended += c.mappings_extended;
+        edges_checked += c.edges_checked;
+        allocations += c.allocations;
+        bytes_allocated += c.bytes_allocated;
+    };
+    
+    // The counters as the fields of a JSON object, without the braces.
+    string json_fields() const{
+        string str = "";
+        
+        str += "\"tree_nodes\":" + to_string(tree_nodes);
+        str += ",\"max_tree_depth\":" + to_string(max_tree_depth);
+        str += ",\"neighborhood_calls\":" + to_string(neighborhood_calls);
+        str += ",\"is_isomorph_to_calls\":" + to_string(iso_calls);
+        str += ",\"rejected_by_hash\":" + to_string(iso_rejected_by_hash);
+        str += ",\"rejected_by_shape\":" + to_string(iso_rejected_by_shape);
+        str += ",\"full_checks\":" + to_string(iso_full_checks);
+        str += ",\"mappings_extended\":" + to_string(mappings_extended);
+        str += ",\"edges_checked\":" + to_string(edges_checked);
+        str += ",\"allocations\":" + to_string(allocations);
+        str += ",\"bytes_allocated\":" + to_string(bytes_allocated);
+        
+        return str;
+    };
+};
 
-// Keeps a list of two integers. It is understood that the first will be mapped to the second
-// while considering Hypergraph isomorphisms.
-typedef class map<int, int> Rule;
+// The counters of one Hypergraph, one HotCounters for each thread.
+class CounterSet{
 
-Rule create_rule_from_vectors(vector<int> a, vector<int> b){
-    int s1 = a.size();
-    int s2 = b.size();
-    Rule r;
+private:
+    vector<HotCounters> per_thread;
+
+public:
+    CounterSet(){
+        per_thread.resize(max(omp_get_max_threads(), omp_get_num_threads()));
+    };
     
-    // If the sizes do not match, return an empty Rule
-    if (s1 != s2)
-        return r;
+    int size(){
+        return per_thread.size();
+    };
+    
+    HotCounters& of_thread(int t){
+        return per_thread[t];
+    };
     
-    for (int i = 0; i < s1; i++)
-        r.insert(Rule::value_type(a[i],b[i]));
+    HotCounters total(){
+        HotCounters c;
+        
+        for (auto& t : per_thread)
+            c.add(t);
+        return c;
+    };
     
-    return r;
+    void clear(){
+        per_thread.assign(per_thread.size(), HotCounters());
+    };
+};
+
+// What the current thread counts into: the counters of the current Hypergraph, or its own
+// counters when it works for no Hypergraph in particular.
+thread_local CounterSet* current_counter_set = nullptr;
+thread_local HotCounters* current_counters = nullptr;
+thread_local HotCounters unattributed_counters;
+
+HotCounters& hot_counters(){
+    return (current_counters != nullptr) ? *current_counters : unattributed_counters;
 }
 
-// Adds two rules and returns the total rule.
-Rule add_two_rules(Rule r1, Rule r2){
-    Rule r = r1;
+// Makes the current thread count into set while the scope lasts, or into no Hypergraph's counters
+// if set is nullptr. Every task opens one, since it may run on any thread, on top of a task that
+// works for some other Hypergraph.
+class CounterScope{
+
+private:
+    CounterSet* saved_set;
+    HotCounters* saved_counters;
+
+public:
+    CounterScope(CounterSet* set){
+        saved_set = current_counter_set;
+        saved_counters = current_counters;
+        
+        int t = omp_get_thread_num();
+        if ((set != nullptr) && (t < set->size())){
+            current_counter_set = set;
+            current_counters = &set->of_thread(t);
+        }
+        else{
+            current_counter_set = nullptr;
+            current_counters = nullptr;
+        }
+    };
+    
+    ~CounterScope(){
+        current_counter_set = saved_set;
+        current_counters = saved_counters;
+    };
+};
+
+string iso_counters_str(const HotCounters& c){
+    string str = "";
     
-    for (auto i : r2)
-        r.insert(i);
+    str += "is_isomorph_to calls: " + to_string(c.iso_calls);
+    str += ", rejected by invariant hash: " + to_string(c.iso_rejected_by_hash);
+    str += ", rejected by other prefilters: " + to_string(c.iso_rejected_by_shape);
+    str += ", full checks: " + to_string(c.iso_full_checks);
     
-    return r;
+    return str;
+}
+
+// Mixes the bits of x (splitmix64 finalizer). Used for hashes that must not depend on the
+// order in which their terms are added up.
+unsigned long long mix_bits(unsigned long long x){
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-void rule_print(Rule r){
+// Keeps a list of (frequency, {vertices})
+typedef class map<int, vector<int> > FrequencyDict;
+
+// Keeps a list of two integers. It is understood that the first will be mapped to the second
+// while considering Hypergraph isomorphisms. The images are kept in an array indexed by the
+// vertex, so that applying a Rule to a Hyperedge is a gather from one contiguous array; hence
+// the vertices should be dense, see Hypergraph::densely_relabeled. Vertices that would make the
+// array much longer than the number of mapped vertices (negative ones, or large labels) are kept
+// aside in a map, so that the memory does not grow with the labels.
+class Rule{
+
+private:
+    vector<int> image;
+    map<int, int> sparse;
+    int num_of_mapped = 0;
+    
+    // True if u is kept in the array: it is already in range, or growing the array up to u keeps
+    // it within a few times the number of mapped vertices. Vertices are mapped in increasing
+    // order by search_mapping_between, so dense vertices all go to the array.
+    bool in_array(int u) const{
+        if (u < 0)
+            return false;
+        return (u < (int) image.size()) || ((long long) u <= 4 * (long long) num_of_mapped + 64);
+    };
+
+public:
+    typedef pair<int, int> value_type;
+    
+    // The image of a vertex that is not mapped; no vertex can be parsed as this number.
+    static constexpr int UNMAPPED = INT_MIN;
+    
+    Rule(){
+    };
+    
+    // Number of mapped vertices.
+    int size() const{
+        return num_of_mapped;
+    };
+    
+    bool empty() const{
+        return num_of_mapped == 0;
+    };
+    
+    // Unmaps every vertex; the array is kept for the next use.
+    void clear(){
+        image.clear();
+        sparse.clear();
+        num_of_mapped = 0;
+    };
+    
+    // 1 if u is mapped, 0 otherwise.
+    int count(int u) const{
+        if ((u >= 0) && (u < (int) image.size()) && (image[u] != UNMAPPED))
+            return 1;
+        return sparse.count(u);
+    };
+    
+    // The image of u. Throws out_of_range if u is not mapped.
+    int at(int u) const{
+        if ((u >= 0) && (u < (int) image.size()) && (image[u] != UNMAPPED))
+            return image[u];
+        auto it = sparse.find(u);
+        if (it == sparse.end())
+            throw out_of_range("Rule::at: the vertex is not mapped");
+        return it->second;
+    };
+    
+    // The image of u. If u is not mapped yet, it is mapped to 0.
+    int& operator[](int u){
+        if (!this->in_array(u) || (sparse.count(u) > 0)){
+            if (sparse.count(u) == 0)
+                num_of_mapped++;
+            return sparse[u];
+        }
+        
+        if (u >= (int) image.size())
+            image.resize(u + 1, UNMAPPED);
+        if (image[u] == UNMAPPED){
+            image[u] = 0;
+            num_of_mapped++;
+        }
+        return image[u];
+    };
+    
+    // Maps p.first to p.second, unless p.first is already mapped.
+    void insert(const value_type& p){
+        if (this->count(p.first) == 0)
+            (*this)[p.first] = p.second;
+    };
+    
+    // The mapped vertices in increasing order.
+    vector<int> domain() const{
+        vector<int> vs;
+        
+        for (auto& p : sparse)
+            vs.push_back(p.first);
+        for (int u = 0; u < (int) image.size(); u++)
+            if (image[u] != UNMAPPED)
+                vs.push_back(u);
+        
+        // A vertex kept in the map may be below the end of the array that grew later.
+        sort(vs.begin(), vs.end());
+        return vs;
+    };
+};
+
+// Index of each vertex in a sorted list of unique vertices uv. If the vertices are dense (as after
+// Hypergraph::densely_relabeled) the indices are kept in an array indexed by the vertex,
+// otherwise they are found by binary search. uv must outlive the VertexIndex.
+class VertexIndex{
+
+private:
+    const vector<int>* uv;
+    int first = 0;
+    vector<int> table;
+
+public:
+    VertexIndex(const vector<int>& vs) : uv(&vs){
+        if (vs.empty())
+            return;
+        
+        long long range = (long long) vs.back() - vs.front() + 1;
+        if (range <= 4 * (long long) vs.size() + 64){
+            first = vs.front();
+            table.assign(range, -1);
+            for (int x = 0; x < (int) vs.size(); x++)
+                table[vs[x] - first] = x;
+        }
+    };
+    
+    // Index of u, or -1 if u is not in uv.
+    int operator()(int u) const{
+        if (!table.empty()){
+            long long k = (long long) u - first;
+            return ((k >= 0) && (k < (long long) table.size())) ? table[k] : -1;
+        }
+        
+        auto it = lower_bound(uv->begin(), uv->end(), u);
+        return ((it == uv->end()) || (*it != u)) ? -1 : it - uv->begin();
+    };
+};
+
+void rule_print(const Rule& r){
     cout << "Rule Print" << endl;
     
-    for (auto i : r)
-        cout << i.first << " -> " << i.second << endl;
+    for (int u : r.domain())
+        cout << u << " -> " << r.at(u) << endl;
 }
 
 // Returns true if f1 and f2 have same number of frequency lists,
 // and the number of elements for each frequency are the same.
-bool is_of_same_shape(FrequencyDict f1, FrequencyDict f2){
+bool is_of_same_shape(const FrequencyDict& f1, const FrequencyDict& f2){
     int s1 = f1.size();
     int s2 = f2.size();
     
@@ -75,324 +345,1232 @@ bool is_of_same_shape(FrequencyDict f1, FrequencyDict f2){
         return false;
     
     // Let us check if both f1 and f2 has the same set of keys.
-    for (auto k: f1)
+    for (const auto& k : f1)
         if (f2.count(k.first) == 0)
             return false;
     
-    for (auto k : f1)
+    for (const auto& k : f1)
         if (k.second.size() != f2.at(k.first).size())
             return false;
     
     return true;
 }
 
-vector<vector <int> > tensor_product(vector<vector <int> > a, vector<vector <int> > b){
-    vector<vector <int> > p;
-    vector<int> c;
-    
-    if (b.size() == 0)
-        return a;
-    
-    for(auto i : a)
-        for (auto j : b){
-            c.empty();
-            c = i;
-            c.insert(c.end(), j.begin(), j.end());
-            p.push_back(c);
-        }
-    
-    return p;
-}
+// VERTEX SETS
+// Sets of dense ids (vertices after Hypergraph::densely_relabeled, indices of Hyperedges or of
+// states) are bitsets of 64-bit words, so that union, intersection and counting handle 64 ids
+// at a time, or 256 with AVX2 (when compiled with -mavx2 or -march=native).
 
-vector<vector <int> > tensor_product_of_all(vector<vector <vector <int> > > a){
-    int s = a.size();
-    
-    vector<vector <int> > p;
-    
-    if (s == 0)
-        return p;
-    if (s == 1)
-        return a[0];
-    
-    p = tensor_product(a[s-2], a[s-1]);
-    
-    // We multiplyy from the end.
-    for (int i = s-3; i >= 0; i--){
-        p = tensor_product(a[i], p);
+// a |= b, over w words.
+void bits_or(uint64_t* a, const uint64_t* b, int w){
+    int i = 0;
+
+#ifdef __AVX2__
+    for (; i + 4 <= w; i += 4){
+        __m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+        _mm256_storeu_si256((__m256i*) (a + i), _mm256_or_si256(x, y));
     }
-    
-    return p;
-    
+#endif
+    for (; i < w; i++)
+        a[i] |= b[i];
 }
 
-vector<vector <int> > permutations_of_vec(vector<int> v){
-    vector< vector<int> > p;
-    
-    do{
-        p.push_back(v);
-    }while(next_permutation(v.begin(), v.end()));
-    
-    return p;
-}
+// a &= b, over w words.
+void bits_and(uint64_t* a, const uint64_t* b, int w){
+    int i = 0;
 
-// We suppose that the "key" in f exists.
-vector<vector <int> > all_permutations_of_dict_with_key(FrequencyDict f, int key){
-    return permutations_of_vec(f.at(key));
+#ifdef __AVX2__
+    for (; i + 4 <= w; i += 4){
+        __m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+        _mm256_storeu_si256((__m256i*) (a + i), _mm256_and_si256(x, y));
+    }
+#endif
+    for (; i < w; i++)
+        a[i] &= b[i];
 }
 
-// Combines rs1 and rs2 in every possible way.
-vector<Rule> tensor_product_of_rules(vector<Rule> rs1, vector<Rule> rs2){
-    vector<Rule> rs;
-    
-    if (rs2.size() == 0)
-        return rs1;
+// True if a and b, of w words, have a common bit.
+bool bits_intersect(const uint64_t* a, const uint64_t* b, int w){
+    int i = 0;
+
+#ifdef __AVX2__
+    for (; i + 4 <= w; i += 4){
+        __m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+        if (!_mm256_testz_si256(x, y))
+            return true;
+    }
+#endif
+    for (; i < w; i++)
+        if (a[i] & b[i])
+            return true;
+    return false;
+}
 
-    if (rs1.size() == 0)
-        return rs2;
+// Number of bits set in a, of w words.
+int bits_count(const uint64_t* a, int w){
+    int c = 0;
     
-    for(auto r1 : rs1)
-        for (auto r2 : rs2)
-            rs.push_back(add_two_rules(r1,r2));
+    for (int i = 0; i < w; i++)
+        c += __builtin_popcountll(a[i]);
     
-    return rs;
+    return c;
 }
 
-// We suppose that the shape of f1 and f2 are the same. This function will be called
-// by Hypergraph Isomorphism function which performs such checks. So f1 and f2 have the
-// same set of "keys"
-vector <Rule> all_permutations_of_two_dict_with_key(FrequencyDict f1, FrequencyDict f2, int key){
+// A set of the ids 0, ..., n-1.
+class Bitset{
+
+private:
+    vector<uint64_t> words;
+    int n = 0;
+
+public:
+    Bitset(){
+    };
     
-    vector<vector <int> > vs = all_permutations_of_dict_with_key(f2, key);
-    vector<int> v1 = f1.at(key);
+    Bitset(int n){
+        this->assign(n);
+    };
     
-    vector <Rule> rs;
+    // Makes this the empty set of the ids 0, ..., n-1; the memory is kept for the next use.
+    void assign(int n){
+        words.assign((n + 63) / 64, 0);
+        this->n = n;
+    };
     
-    for (auto v2 : vs)
-        rs.push_back(create_rule_from_vectors(v1,v2));
+    int size() const{
+        return n;
+    };
     
-    return rs;
-}
-
-// Returns the list of keys of f.
-vector<int> keys_of_freq_dict(FrequencyDict f){
-    vector<int> keys;
+    int num_of_words() const{
+        return words.size();
+    };
     
-    for (auto i : f)
-        keys.push_back(i.first);
+    uint64_t* data(){
+        return words.data();
+    };
     
-    return keys;
-}
-
-// The function "all_permutations_of_two_dict_with_key" is what we will use.
-// We need to iterate over all keys, and combine rules.
-vector <Rule> all_permutations_of_two_dicts(FrequencyDict f1, FrequencyDict f2){
-    vector <Rule> all_rules;
-    vector<int> keys = keys_of_freq_dict(f1);
-    vector<vector <Rule> > vr;
+    const uint64_t* data() const{
+        return words.data();
+    };
+    
+    void set(int i){
+        words[i >> 6] |= 1ULL << (i & 63);
+    };
     
-    // Now we reverse the order of keys, that is least frequenct vertices are looped over at first.
-    sort(keys.begin(), keys.end());
-    reverse(keys.begin(), keys.end());
+    void reset(int i){
+        words[i >> 6] &= ~(1ULL << (i & 63));
+    };
     
-    for (int k : keys)
-        vr.push_back(all_permutations_of_two_dict_with_key(f1, f2, k));
+    bool test(int i) const{
+        return (words[i >> 6] >> (i & 63)) & 1;
+    };
     
-    // Now vs holds all the information about Rules. We need to perform a tensor product.
-    int s = vr.size();
+    void clear(){
+        fill(words.begin(), words.end(), 0);
+    };
     
-    if (s <= 1)
-        return vr[0];
+    // Number of ids in the set.
+    int count() const{
+        return bits_count(words.data(), words.size());
+    };
     
-    // Now s >= 2
-    all_rules = tensor_product_of_rules(vr[s-2], vr[s-1]);
+    bool intersects(const Bitset& b) const{
+        return bits_intersect(words.data(), b.words.data(), min(words.size(), b.words.size()));
+    };
     
-    if (s == 2)
-        return all_rules;
+    Bitset& operator|=(const Bitset& b){
+        bits_or(words.data(), b.words.data(), min(words.size(), b.words.size()));
+        return *this;
+    };
     
-    // Now s >= 3
-    for (int i = s-3; i >= 0; i--)
-        all_rules = tensor_product_of_rules(vr[i], all_rules);
+    Bitset& operator&=(const Bitset& b){
+        bits_and(words.data(), b.words.data(), min(words.size(), b.words.size()));
+        if (words.size() > b.words.size())
+            fill(words.begin() + b.words.size(), words.end(), 0);
+        return *this;
+    };
     
-    return all_rules;
-}
+    // Calls f(i) for each id i of the set, in increasing order.
+    template <class F>
+    void for_each(F f) const{
+        for (int k = 0; k < (int) words.size(); k++)
+            for (uint64_t x = words[k]; x != 0; x &= x - 1)
+                f(64 * k + __builtin_ctzll(x));
+    };
+};
 
-void vec_print(vector<int> v){
-  int s = v.size();
+// SMALL HYPEREDGES
+// The Hyperedges of Wolfram models have arity 2 or 3 almost always. Their vertices are kept in
+// the Hyperedge itself (see VertexList), and Hyperedges of a fixed arity A are compared by
+// EdgeOps<A>, whose loops the compiler unrolls; EdgeOps<2> and EdgeOps<3> are written out
+// without branches. Each Hyperedge is dispatched to EdgeOps by its arity, which is fixed when
+// the Hyperedge is read.
 
-  cout << "{";
-  for (int i = 0; i < s; i++){
-        cout << v[i];
-	if (i < s-1)
-	  cout << ",";
-  }
-    cout << "}" << endl;
-}
+template <int A>
+struct EdgeOps{
+    static bool equal(const int* a, const int* b){
+        bool eq = true;
+        for (int i = 0; i < A; i++)
+            eq &= (a[i] == b[i]);
+        return eq;
+    };
+    
+    static bool contains(const int* a, int u){
+        bool found = false;
+        for (int i = 0; i < A; i++)
+            found |= (a[i] == u);
+        return found;
+    };
+};
 
-string vec_str(vector<int> v){
-  int s = v.size();
+template <>
+struct EdgeOps<2>{
+    static bool equal(const int* a, const int* b){
+        return ((a[0] ^ b[0]) | (a[1] ^ b[1])) == 0;
+    };
+    
+    static bool contains(const int* a, int u){
+        return (a[0] == u) | (a[1] == u);
+    };
+};
 
-  string str = "";
+template <>
+struct EdgeOps<3>{
+    static bool equal(const int* a, const int* b){
+        return ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2])) == 0;
+    };
     
-  str += "{";
-  for (int i = 0; i < s; i++){
-        str += to_string(v[i]);
-    if (i < s-1)
-      str += ",";
-  }
-    str += "}";
+    static bool contains(const int* a, int u){
+        return (a[0] == u) | (a[1] == u) | (a[2] == u);
+    };
+};
+
+// True if the n vertices at a and at b are the same.
+bool equal_vertices(const int* a, const int* b, int n){
+    switch (n){
+        case 2: return EdgeOps<2>::equal(a, b);
+        case 3: return EdgeOps<3>::equal(a, b);
+    }
     
-    return str;
+    for (int i = 0; i < n; i++)
+        if (a[i] != b[i])
+            return false;
+    return true;
 }
 
-void freq_dict_print(FrequencyDict f){
-    for (auto i : f){
-        cout << i.first << ": ";
-        vec_print(i.second);
-        cout << endl;
+// True if u is among the n vertices at a.
+bool contains_vertex(const int* a, int n, int u){
+    switch (n){
+        case 2: return EdgeOps<2>::contains(a, u);
+        case 3: return EdgeOps<3>::contains(a, u);
     }
+    
+    for (int i = 0; i < n; i++)
+        if (a[i] == u)
+            return true;
+    return false;
 }
 
-int max_vec_int(const vector<int> v){
-    int m = v[0];
-    int s = v.size();
-    for (int i = 0; i < s; i++)
-        if (m < v[i])
-            m = v[i];
-    return m;
+// True if the na vertices at a and the nb vertices at b have a vertex in common.
+bool intersect_vertices(const int* a, int na, const int* b, int nb){
+    bool found = false;
+    
+    switch (na){
+        case 2:
+            for (int j = 0; j < nb; j++)
+                found |= EdgeOps<2>::contains(a, b[j]);
+            return found;
+        case 3:
+            for (int j = 0; j < nb; j++)
+                found |= EdgeOps<3>::contains(a, b[j]);
+            return found;
+    }
+    
+    for (int j = 0; j < nb; j++)
+        if (contains_vertex(a, na, b[j]))
+            return true;
+    return false;
 }
 
+// Hyperedges with at most this many vertices do not allocate.
+const int INLINE_ARITY = 4;
 
-// DEFINITIONS OF CLASSES AND RELATED FUNCTIONS
-// 1. Hyperedge
-// 2. Hypergraph
-// 3. Tree
+// The vertices of a Hyperedge. Up to INLINE_ARITY of them are stored in the object itself, so
+// that small Hyperedges are created and copied without the heap; more are stored on the heap.
+class VertexList{
 
-class Hyperedge{
-    
 private:
-    vector<int> vertices;
-    
-public:
-    // vs stands for vertices.
-    Hyperedge(vector<int> vs){
-        this->vertices = vs;
+    int count = 0;
+    int capacity = INLINE_ARITY;
+    union{
+        int local[INLINE_ARITY];
+        int* heap;
     };
     
-    Hyperedge(string str){
-        int s = str.length();
-        int pos_pre = 1;
+    // Moves the vertices to a heap buffer of c > capacity vertices.
+    void grow(int c){
+        int* p = new int[c];
         
-        if ((str[0] == '{') && (str[s-1] == '}')){
-            for (int pos = 1; pos < s-1; pos++)
-                if ((str[pos] == ',') || (pos == s-2)){
-                    vertices.push_back(stoi(str.substr(pos_pre, pos-pos_pre+1)));
-                    pos_pre = pos + 1;
-                }
-        }
-            
+        copy(this->begin(), this->end(), p);
+        if (capacity > INLINE_ARITY)
+            delete[] heap;
+        heap = p;
+        capacity = c;
     };
     
-    // empty constructor
-    Hyperedge(){
+    void release(){
+        if (capacity > INLINE_ARITY)
+            delete[] heap;
+        capacity = INLINE_ARITY;
+        count = 0;
     };
     
-    // Get vertex at position i.
-    int get(int i){
-        return vertices[i];
+    // Takes over the heap buffer of vl, or copies its inline vertices.
+    void take(VertexList& vl){
+        if (vl.capacity > INLINE_ARITY){
+            this->release();
+            heap = vl.heap;
+            capacity = vl.capacity;
+            count = vl.count;
+            vl.capacity = INLINE_ARITY;
+            vl.count = 0;
+        }
+        else
+            this->assign(vl.begin(), vl.end());
+    };
+
+public:
+    VertexList(){
     };
     
-    vector<int> get_vertices(){
-        return vertices;
+    VertexList(const int* first, const int* last){
+        this->assign(first, last);
     };
     
-    // Remove the vertices.
-    void clear(){
-        vertices.clear();
+    VertexList(const VertexList& vl){
+        this->assign(vl.begin(), vl.end());
     };
     
-    void append(int v){
-        this->vertices.push_back(v);
+    VertexList(VertexList&& vl){
+        this->take(vl);
     };
     
-    void append(Hyperedge& he){
-        int s = he.size();
-        for (int i = 0; i < s; i++)
-            this->append(he.get(i));
+    VertexList& operator=(const VertexList& vl){
+        if (this != &vl)
+            this->assign(vl.begin(), vl.end());
+        return *this;
     };
     
-    // Returns true if u is an element of Hyperedge, false otherwise.
-    bool is_elem(int u){
-        for (int v : vertices)
-            if (u == v)
-                return true;
-        return false;
+    VertexList& operator=(VertexList&& vl){
+        if (this != &vl)
+            this->take(vl);
+        return *this;
     };
     
-    // Returns how many times the vertex `v` appears in the Hypergraph
-    int frequency_of_vertex(int v){
-        int c = 0;
-        for (int u : vertices)
-            if (u == v)
-                c++;
+    ~VertexList(){
+        this->release();
+    };
+    
+    void assign(const int* first, const int* last){
+        const int n = last - first;
         
-        return c;
+        count = 0;
+        if (n > capacity)
+            this->grow(n);
+        copy(first, last, this->data());
+        count = n;
     };
     
-    int size(){
-        return vertices.size();
+    void reserve(int n){
+        if (n > capacity)
+            this->grow(n);
     };
     
-    // Returns a sorted list of unique elements of Hyperedge.
-    Hyperedge unique_vertices(){
-        vector<int> he = this->vertices;
-        
-        // If there is at most one element, return he.
-        int s = he.size();
-        if (s <= 1)
-            return he;
-        
-        // We sort the vector.
-        sort(he.begin(), he.end());
-        
-        // Remove the duplicate elements
-        for(int i = 1; i < s; i++){
-            if (he.at(i) == he.at(i-1)){
-                he.erase(he.begin() + i);
-                i -= 1;
-                s -= 1;
-            }
-        }
-        return he;
+    // Keeps the first n vertices; new ones are 0.
+    void resize(int n){
+        this->reserve(n);
+        if (n > count)
+            fill(this->data() + count, this->data() + n, 0);
+        count = n;
     };
     
-    // Returns true if there is nonzero intersection, false otherwise.
-    bool does_intersect_with(Hyperedge& he){
-        for (int u : vertices)
-            if (he.is_elem(u))
-                return true;
-        
-        return false;
+    void push_back(int u){
+        if (count == capacity)
+            this->grow(2 * capacity);
+        this->data()[count++] = u;
     };
     
-    Hyperedge map_via_rule(Rule r){
-        Hyperedge he;
-        
-        for (int i : this->vertices)
-            he.append(r.at(i));
-        
-        return he;
+    void clear(){
+        count = 0;
     };
     
-    // Apply rule to "this" Hyperedge and check equality with he2.
-    bool is_isomorph_to_via_rule(Rule r, Hyperedge he2){
-        return this->map_via_rule(r) == he2;
+    int size() const{
+        return count;
     };
     
-    friend bool operator==(const Hyperedge& he1, const Hyperedge& he2);
-    friend bool operator!=(const Hyperedge& he1, const Hyperedge& he2);
+    bool empty() const{
+        return count == 0;
+    };
     
-    // If newline = false, endl is not printed at the end.
-    void print(bool newline = true){
+    int* data(){
+        return (capacity > INLINE_ARITY) ? heap : local;
+    };
+    
+    const int* data() const{
+        return (capacity > INLINE_ARITY) ? heap : local;
+    };
+    
+    int* begin(){
+        return this->data();
+    };
+    
+    int* end(){
+        return this->data() + count;
+    };
+    
+    const int* begin() const{
+        return this->data();
+    };
+    
+    const int* end() const{
+        return this->data() + count;
+    };
+    
+    int operator[](int i) const{
+        return this->data()[i];
+    };
+    
+    // A copy of the vertices as a vector.
+    operator vector<int>() const{
+        return vector<int>(this->begin(), this->end());
+    };
+};
+
+bool operator==(const VertexList& a, const VertexList& b){
+    return (a.size() == b.size()) && equal_vertices(a.data(), b.data(), a.size());
+}
+
+bool operator!=(const VertexList& a, const VertexList& b){
+    return !(a == b);
+}
+
+// Multiset of Hyperedges, hashed by their vertices. The distinct Hyperedges are stored flat
+// (Hyperedge i is vertices[offsets[i]] ... vertices[offsets[i+1]-1]) with their multiplicities,
+// and found through an open addressing table, so that a lookup costs one hash and a few
+// comparisons and allocates nothing. clear() keeps the memory for the next use.
+class EdgeMultiset{
+
+private:
+    vector<int> vertices;
+    vector<int> offsets = vector<int>(1, 0);
+    vector<int> counts;
+    int total = 0;
+    
+    // Indices of the distinct Hyperedges, or -1; the size is a power of two.
+    vector<int> slots;
+    
+    static unsigned long long hash_of(const int* vs, int n){
+        unsigned long long h = mix_bits(n);
+        
+        for (int i = 0; i < n; i++)
+            h = mix_bits(h + (unsigned int) vs[i]);
+        
+        return h;
+    };
+    
+    void insert_slot(int i){
+        const size_t mask = slots.size() - 1;
+        size_t s = hash_of(vertices.data() + offsets[i], offsets[i+1] - offsets[i]) & mask;
+        
+        while (slots[s] >= 0)
+            s = (s + 1) & mask;
+        slots[s] = i;
+    };
+
+public:
+    EdgeMultiset(){
+    };
+    
+    void clear(){
+        vertices.clear();
+        offsets.assign(1, 0);
+        counts.clear();
+        total = 0;
+        fill(slots.begin(), slots.end(), -1);
+    };
+    
+    // Adds one copy of the Hyperedge made of the n vertices at vs.
+    void add(const int* vs, int n){
+        int i = this->find(vs, n);
+        
+        total++;
+        if (i >= 0){
+            counts[i]++;
+            return;
+        }
+        
+        // The table is kept at most half full.
+        if (2 * (counts.size() + 1) > slots.size()){
+            slots.assign(max((size_t) 16, 2 * slots.size()), -1);
+            for (int j = 0; j < (int) counts.size(); j++)
+                this->insert_slot(j);
+        }
+        
+        vertices.insert(vertices.end(), vs, vs + n);
+        offsets.push_back(vertices.size());
+        counts.push_back(1);
+        this->insert_slot(counts.size() - 1);
+    };
+    
+    // Index of the distinct Hyperedge made of the n vertices at vs, or -1 if there is none.
+    int find(const int* vs, int n) const{
+        if (slots.empty())
+            return -1;
+        
+        const size_t mask = slots.size() - 1;
+        for (size_t s = hash_of(vs, n) & mask; slots[s] >= 0; s = (s + 1) & mask){
+            int i = slots[s];
+            if ((offsets[i+1] - offsets[i] == n) && equal_vertices(vertices.data() + offsets[i], vs, n))
+                return i;
+        }
+        
+        return -1;
+    };
+    
+    // Number of distinct Hyperedges.
+    int num_of_distinct() const{
+        return counts.size();
+    };
+    
+    // Number of Hyperedges, with their multiplicities.
+    int size() const{
+        return total;
+    };
+    
+    // Multiplicities of the distinct Hyperedges, by index.
+    const vector<int>& multiplicities() const{
+        return counts;
+    };
+};
+
+// State of the backtracking search for a vertex mapping between two Hypergraphs.
+// Vertices of the first Hypergraph are referred to by their position in the mapping order,
+// vertices of the second Hypergraph by their indices among its unique vertices.
+struct MappingSearch{
+    // classes[c] is the list of vertices of the second Hypergraph of color c, class_of[k] is
+    // the color of the k-th vertex to be mapped.
+    vector<vector<int> > classes;
+    vector<int> class_of;
+    
+    // closing_edges[k] are the Hyperedges (as positions) whose last vertex to be mapped is the k-th one.
+    vector<vector<vector<int> > > closing_edges;
+    
+    // Hyperedges of the second Hypergraph, and how many copies of each (by its index in edges2)
+    // are not matched yet.
+    EdgeMultiset edges2;
+    vector<int> remaining;
+    
+    // Buffer for the image of a Hyperedge.
+    vector<int> mapped;
+    
+    // image[k] is where the k-th vertex is mapped to; used[u] is 1 if some vertex is.
+    vector<int> image;
+    vector<char> used;
+    
+    // If has_preferred[k], preferred[k] is tried first for the k-th vertex. It must be in its class.
+    vector<bool> has_preferred;
+    vector<int> preferred;
+    
+    // candidates[k] holds the candidates of the k-th vertex while it is being mapped. Each vertex
+    // has its own buffer, reserved to the size of its class, so a step of the search does not
+    // allocate.
+    vector<vector<int> > candidates;
+    
+    // When the search is split into tasks, the others stop once stop becomes true.
+    const atomic<bool>* stop = nullptr;
+    
+    // If given, the number of vertex mappings that may still be extended. The search gives up,
+    // as if there were no mapping, once it is spent.
+    long long* budget = nullptr;
+};
+
+// Searches with at least this many vertices are split into one task per candidate of the
+// first vertex, if they run inside an OpenMP parallel region.
+const int PARALLEL_SEARCH_MIN_VERTICES = 12;
+
+bool search_vertex_mapping(MappingSearch& ms, int k);
+
+// Maps the k-th vertex to u and, if the Hyperedges that become fully mapped are all among the
+// remaining ones, goes on with the next vertex. Everything is undone unless a complete mapping
+// is found. u must not be used yet.
+bool try_vertex_mapping(MappingSearch& ms, int k, int u){
+    vector<vector<int> >& edges = ms.closing_edges[k];
+    const int s = edges.size();
+    vector<int>& mapped = ms.mapped;
+    
+    if (ms.budget != nullptr){
+        if (*ms.budget <= 0)
+            return false;
+        (*ms.budget)--;
+    }
+    
+    ms.image[k] = u;
+    hot_counters().mappings_extended++;
+    
+    // Every Hyperedge that is now fully mapped must be among the remaining ones.
+    int matched = 0;
+    bool ok = true;
+    for (; matched < s; matched++){
+        hot_counters().edges_checked++;
+        mapped.clear();
+        for (int p : edges[matched])
+            mapped.push_back(ms.image[p]);
+        
+        int i = ms.edges2.find(mapped.data(), mapped.size());
+        if ((i < 0) || (ms.remaining[i] == 0)){
+            ok = false;
+            break;
+        }
+        ms.remaining[i]--;
+    }
+    
+    if (ok){
+        ms.used[u] = 1;
+        if (search_vertex_mapping(ms, k+1))
+            return true;
+        ms.used[u] = 0;
+    }
+    
+    // Undo the matches of this candidate.
+    for (int i = 0; i < matched; i++){
+        mapped.clear();
+        for (int p : edges[i])
+            mapped.push_back(ms.image[p]);
+        ms.remaining[ms.edges2.find(mapped.data(), mapped.size())]++;
+    }
+    
+    return false;
+}
+
+// The candidates of the k-th vertex, the preferred one first, in the buffer ms.candidates[k].
+const vector<int>& candidates_of_vertex(MappingSearch& ms, int k){
+    vector<int>& cs = ms.candidates[k];
+    
+    cs.clear();
+    if (ms.has_preferred[k])
+        cs.push_back(ms.preferred[k]);
+    for (int u : ms.classes[ms.class_of[k]])
+        if (!ms.has_preferred[k] || (u != ms.preferred[k]))
+            cs.push_back(u);
+    
+    return cs;
+}
+
+// Maps the k-th vertex to each free candidate in turn and checks the Hyperedges that become
+// fully mapped. Returns true as soon as a complete mapping is found.
+bool search_vertex_mapping(MappingSearch& ms, int k){
+    if (k == (int) ms.class_of.size())
+        return true;
+    
+    if ((ms.stop != nullptr) && ms.stop->load(memory_order_relaxed))
+        return false;
+    
+    for (int u : candidates_of_vertex(ms, k))
+        if (!ms.used[u])
+            if (try_vertex_mapping(ms, k, u))
+                return true;
+    
+    return false;
+}
+
+// Same as search_vertex_mapping(ms, 0), but each candidate of the first vertex is tried in its
+// own OpenMP task on a copy of ms. The first task that finds a mapping stops the others, and
+// its mapping is copied back into ms.
+bool search_vertex_mapping_in_tasks(MappingSearch& ms){
+    const vector<int>& cs = candidates_of_vertex(ms, 0);
+    atomic<bool> found(false);
+    const int c = cs.size();
+    CounterSet* counters = current_counter_set;
+    
+    #pragma omp taskgroup
+    {
+        for (int t = 0; t < c; t++){
+            #pragma omp task default(shared) firstprivate(t)
+            {
+                CounterScope scope(counters);
+                MappingSearch local = ms;
+                local.stop = &found;
+                
+                if (!found.load(memory_order_relaxed) && try_vertex_mapping(local, 0, cs[t])){
+                    #pragma omp critical(search_vertex_mapping_in_tasks)
+                    {
+                        if (!found.load()){
+                            ms.image = local.image;
+                            found.store(true);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    return found.load();
+}
+
+// Signature of vertex x: its color followed by the sorted list of its occurrences. An occurrence
+// in Hyperedge e at position p is written as (arity of e, p, colors of the vertices of e).
+vector<int> vertex_signature(vector<vector<int> >& edges, vector<vector<int> >& incident,
+                             vector<int>& color, int x){
+    vector<vector<int> > occurrences;
+    vector<int> o;
+    
+    for (int i : incident[x]){
+        const int a = edges[i].size();
+        for (int p = 0; p < a; p++)
+            if (edges[i][p] == x){
+                o.clear();
+                o.push_back(a);
+                o.push_back(p);
+                for (int y : edges[i])
+                    o.push_back(color[y]);
+                occurrences.push_back(o);
+            }
+    }
+    sort(occurrences.begin(), occurrences.end());
+    
+    vector<int> sig;
+    sig.push_back(color[x]);
+    for (auto& occ : occurrences)
+        sig.insert(sig.end(), occ.begin(), occ.end());
+    
+    return sig;
+}
+
+// Refines the vertex colors of two Hypergraphs together until the number of colors stops growing.
+// The Hypergraphs are given as Hyperedges on vertex indices 0..n-1. At the start every vertex has
+// the same color, so the first round already separates vertices by their occurrences at each
+// position and the arities of their Hyperedges; later rounds take the colors of the neighbours
+// into account. Since both Hypergraphs share the same table of signatures, a color means the same
+// thing on both sides. Returns false if some color is not equally frequent in both Hypergraphs,
+// in which case they cannot be isomorphic. If keep_colors is true, the given colors are refined
+// instead. With n2 = 0 a single Hypergraph is refined.
+bool refine_vertex_colors(vector<vector<int> >& edges1, int n1, vector<vector<int> >& edges2, int n2,
+                          vector<int>& color1, vector<int>& color2, bool keep_colors = false){
+    vector<vector<int> > incident1(n1), incident2(n2);
+    
+    for (int i = 0; i < (int) edges1.size(); i++)
+        for (int x : edges1[i])
+            if (incident1[x].empty() || (incident1[x].back() != i))
+                incident1[x].push_back(i);
+    for (int i = 0; i < (int) edges2.size(); i++)
+        for (int x : edges2[i])
+            if (incident2[x].empty() || (incident2[x].back() != i))
+                incident2[x].push_back(i);
+    
+    if (!keep_colors){
+        color1.assign(n1, 0);
+        color2.assign(n2, 0);
+    }
+    set<int> initial_colors(color1.begin(), color1.end());
+    initial_colors.insert(color2.begin(), color2.end());
+    int num_of_colors = initial_colors.size();
+    
+    while (true){
+        vector<vector<int> > sig1(n1), sig2(n2);
+        map<vector<int>, int> table;
+        
+        for (int x = 0; x < n1; x++){
+            sig1[x] = vertex_signature(edges1, incident1, color1, x);
+            table[sig1[x]] = 0;
+        }
+        for (int x = 0; x < n2; x++){
+            sig2[x] = vertex_signature(edges2, incident2, color2, x);
+            table[sig2[x]] = 0;
+        }
+        
+        // New colors are given in the order of signatures, so they do not depend on labels.
+        int c = 0;
+        for (auto& t : table)
+            t.second = c++;
+        
+        vector<int> count(c, 0);
+        for (int x = 0; x < n1; x++){
+            color1[x] = table.at(sig1[x]);
+            count[color1[x]]++;
+        }
+        for (int x = 0; x < n2; x++){
+            color2[x] = table.at(sig2[x]);
+            count[color2[x]]--;
+        }
+        
+        if (n2 > 0)
+            for (int k : count)
+                if (k != 0)
+                    return false;
+        
+        if (c == num_of_colors)
+            return true;
+        num_of_colors = c;
+    }
+}
+
+// Backtracking search for a vertex mapping between two Hypergraphs with the sorted unique vertices
+// uv1 and uv2, given as Hyperedges on the indices of their vertices (edges1, edges2) and the
+// colors of the indices from refine_vertex_colors, which must agree. mapping is the hint, and the
+// result if a mapping is found (see Hypergraph::is_isomorph_to). If budget is given, at most that
+// many vertex mappings are extended (see MappingSearch), and they are taken off it.
+bool search_mapping_between(vector<vector<int> >& edges1, vector<int>& color1, const vector<int>& uv1,
+                            vector<vector<int> >& edges2, vector<int>& color2, const vector<int>& uv2,
+                            Rule& mapping, long long* budget = nullptr){
+    const int n = uv1.size();
+    const int e = edges1.size();
+    MappingSearch ms;
+    VertexIndex index2(uv2);
+    
+    // The candidates of each color in the second Hypergraph.
+    int num_of_colors = 0;
+    for (int c : color1)
+        num_of_colors = max(num_of_colors, c + 1);
+    vector<int> class_size(num_of_colors, 0);
+    ms.classes.resize(num_of_colors);
+    for (int x = 0; x < n; x++){
+        class_size[color1[x]]++;
+        ms.classes[color2[x]].push_back(x);
+    }
+    
+    // The Hyperedges incident to each vertex.
+    vector<vector<int> > incident(n);
+    for (int i = 0; i < e; i++)
+        for (int x : edges1[i])
+            if (incident[x].empty() || (incident[x].back() != i))
+                incident[x].push_back(i);
+    
+    // We choose the order of vertices greedily: next comes the vertex that shares the most
+    // Hyperedges with the vertices already ordered, ties are broken by the smaller class.
+    // This way the Hyperedges are closed, and checked, as early as possible.
+    vector<int> position(n, -1);
+    vector<int> score(n, 0);
+    for (int k = 0; k < n; k++){
+        int best = -1;
+        for (int x = 0; x < n; x++){
+            if (position[x] >= 0)
+                continue;
+            if ((best < 0) || (score[x] > score[best]) ||
+                ((score[x] == score[best]) && (class_size[color1[x]] < class_size[color1[best]])))
+                best = x;
+        }
+        position[best] = k;
+        ms.class_of.push_back(color1[best]);
+        
+        // The hint is only used if it respects the colors.
+        int y = (mapping.count(uv1[best]) > 0) ? index2(mapping.at(uv1[best])) : -1;
+        bool hinted = (y >= 0) && (color2[y] == color1[best]);
+        ms.has_preferred.push_back(hinted);
+        ms.preferred.push_back(hinted ? y : 0);
+        for (int i : incident[best])
+            for (int x : edges1[i])
+                if (position[x] < 0)
+                    score[x]++;
+    }
+    
+    // Each Hyperedge is checked once its last vertex is mapped. Empty Hyperedges are
+    // already matched by the size_nub test.
+    ms.closing_edges.resize(n);
+    for (int i = 0; i < e; i++){
+        if (edges1[i].empty())
+            continue;
+        vector<int> positions;
+        int last = 0;
+        for (int x : edges1[i]){
+            positions.push_back(position[x]);
+            last = max(last, position[x]);
+        }
+        ms.closing_edges[last].push_back(positions);
+    }
+    
+    for (auto& e2 : edges2)
+        if (!e2.empty())
+            ms.edges2.add(e2.data(), e2.size());
+    ms.remaining = ms.edges2.multiplicities();
+    
+    ms.image.resize(n);
+    ms.used.assign(n, 0);
+    ms.budget = budget;
+    ms.candidates.resize(n);
+    for (int k = 0; k < n; k++)
+        ms.candidates[k].reserve(ms.classes[ms.class_of[k]].size());
+    
+    // A budgeted search is not split, since the tasks would share the budget.
+    bool found;
+    if ((n >= PARALLEL_SEARCH_MIN_VERTICES) && omp_in_parallel() && (budget == nullptr))
+        found = search_vertex_mapping_in_tasks(ms);
+    else
+        found = search_vertex_mapping(ms, 0);
+    
+    if (!found)
+        return false;
+    
+    mapping.clear();
+    for (int x = 0; x < n; x++)
+        mapping[uv1[x]] = uv2[ms.image[position[x]]];
+    
+    return true;
+}
+
+// Canonical form of a Hypergraph: its Hyperedges relabeled by a labeling of the vertices that
+// does not depend on the original labels, and sorted. Isomorphic Hypergraphs, and only they,
+// have the same canonical form.
+struct CanonicalForm{
+    // False if the search was given up (see canonical_form).
+    bool found = false;
+    int num_of_vertices = 0;
+    vector<vector<int> > edges;
+    
+    // labeling[x] is the canonical label of the x-th unique vertex.
+    vector<int> labeling;
+    unsigned long long hash = 0;
+};
+
+// Hash of a list of Hyperedges on the vertices 0, ..., n-1, taking the order into account.
+unsigned long long hash_of_edges(const vector<vector<int> >& edges, int n){
+    unsigned long long h = mix_bits(n);
+    
+    for (auto& e : edges){
+        h = mix_bits(h ^ (0x100000000ULL + e.size()));
+        for (int x : e)
+            h = mix_bits(h ^ x);
+    }
+    
+    return h;
+}
+
+// The search for the canonical labeling gives up after this many refinements.
+const int CANONICAL_SEARCH_BUDGET = 10000;
+
+// The search for an automorphism that moves some vertex gives up after this many vertex mappings
+// (see Hypergraph::find_moving_automorphism).
+const long long AUTOMORPHISM_SEARCH_BUDGET = 100000;
+
+// Individualization-refinement: the colors are refined, and while some color is shared by several
+// vertices, each of these vertices in turn gets a color of its own and the search goes on. Every
+// branch ends with all colors distinct, which is a labeling; the one that gives the smallest sorted
+// Hyperedge list wins. Since the branches do not depend on labels, neither does the winner.
+void search_canonical_labeling(vector<vector<int> >& edges, int n, vector<int> color, CanonicalForm& cf, int& budget){
+    vector<vector<int> > none;
+    vector<int> none_color;
+    
+    if (budget-- <= 0)
+        return;
+    
+    refine_vertex_colors(edges, n, none, 0, color, none_color, true);
+    
+    // The first color with the fewest vertices, among those shared by several vertices.
+    vector<int> size_of_color(n, 0);
+    for (int x = 0; x < n; x++)
+        size_of_color[color[x]]++;
+    int target = -1;
+    for (int c = 0; c < n; c++)
+        if ((size_of_color[c] > 1) && ((target < 0) || (size_of_color[c] < size_of_color[target])))
+            target = c;
+    
+    if (target < 0){
+        vector<vector<int> > relabeled = edges;
+        for (auto& e : relabeled)
+            for (int& x : e)
+                x = color[x];
+        sort(relabeled.begin(), relabeled.end());
+        
+        if (!cf.found || (relabeled < cf.edges)){
+            cf.found = true;
+            cf.edges = relabeled;
+            cf.labeling = color;
+        }
+        return;
+    }
+    
+    for (int x = 0; x < n; x++)
+        if (color[x] == target){
+            // x comes just before the other vertices of its color.
+            vector<int> individualized(n);
+            for (int y = 0; y < n; y++)
+                individualized[y] = 2*color[y] + ((y == x) ? 0 : 1);
+            
+            search_canonical_labeling(edges, n, individualized, cf, budget);
+        }
+}
+
+void vec_print(const vector<int>& v){
+  int s = v.size();
+  
+  cout << "{";
+  for (int i = 0; i < s; i++){
+        cout << v[i];
+	if (i < s-1)
+	  cout << ",";
+  }
+    cout << "}" << endl;
+}
+
+string vec_str(const vector<int>& v){
+  int s = v.size();
+  
+  string str = "";
+  
+  str += "{";
+  for (int i = 0; i < s; i++){
+        str += to_string(v[i]);
+    if (i < s-1)
+      str += ",";
+  }
+    str += "}";
+    
+    return str;
+}
+
+void freq_dict_print(const FrequencyDict& f){
+    for (const auto& i : f){
+        cout << i.first << ": ";
+        vec_print(i.second);
+        cout << endl;
+    }
+}
+
+int max_vec_int(const vector<int>& v){
+    int m = v[0];
+    int s = v.size();
+    for (int i = 0; i < s; i++)
+        if (m < v[i])
+            m = v[i];
+    return m;
+}
+
+
+// Parses a Hypergraph written as {{1,2},{2,3}} in [begin, end) without creating any string.
+// Whitespace is allowed between the tokens. The Hyperedges are appended to vertices and offsets
+// in the flat form of FlatHypergraph: Hyperedge i is vertices[offsets[i]] ... vertices[offsets[i+1]-1],
+// and offsets must already hold its first element. If the text is malformed, false is returned,
+// error_pos points to the offending character and error_msg says what was expected there.
+bool parse_hypergraph(const char* begin, const char* end, vector<int>& vertices, vector<int>& offsets,
+                      const char*& error_pos, const char*& error_msg){
+    const char* p = begin;
+    
+    auto skip_spaces = [&](){
+        while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+            p++;
+    };
+    auto fail = [&](const char* msg){
+        error_pos = p;
+        error_msg = msg;
+        return false;
+    };
+    
+    skip_spaces();
+    if ((p == end) || (*p != '{'))
+        return fail("expected '{' at the beginning of the hypergraph");
+    p++;
+    skip_spaces();
+    
+    // An empty Hypergraph is allowed.
+    bool first_edge = true;
+    while ((p < end) && (*p != '}')){
+        if (!first_edge){
+            if (*p != ',')
+                return fail("expected ',' or '}' after a hyperedge");
+            p++;
+            skip_spaces();
+        }
+        first_edge = false;
+        
+        if ((p == end) || (*p != '{'))
+            return fail("expected '{' at the beginning of a hyperedge");
+        p++;
+        skip_spaces();
+        
+        bool first_vertex = true;
+        while ((p < end) && (*p != '}')){
+            if (!first_vertex){
+                if (*p != ',')
+                    return fail("expected ',' or '}' after a vertex");
+                p++;
+                skip_spaces();
+            }
+            first_vertex = false;
+            
+            bool negative = false;
+            if ((p < end) && (*p == '-')){
+                negative = true;
+                p++;
+            }
+            if ((p == end) || (*p < '0') || (*p > '9'))
+                return fail("expected a vertex (an integer)");
+            
+            long long v = 0;
+            while ((p < end) && (*p >= '0') && (*p <= '9')){
+                v = 10*v + (*p - '0');
+                if (v > 2147483647LL)
+                    return fail("vertex is out of the range of int");
+                p++;
+            }
+            vertices.push_back(negative ? -v : v);
+            skip_spaces();
+        }
+        
+        if (p == end)
+            return fail("expected '}' at the end of a hyperedge");
+        p++;
+        offsets.push_back(vertices.size());
+        skip_spaces();
+    }
+    
+    if (p == end)
+        return fail("expected '}' at the end of the hypergraph");
+    p++;
+    skip_spaces();
+    
+    if (p != end)
+        return fail("unexpected text after the hypergraph");
+    
+    return true;
+}
+
+// DEFINITIONS OF CLASSES AND RELATED FUNCTIONS
+// 1. Hyperedge
+// 2. Hypergraph
+// 3. Tree
+
+class Hyperedge{
+    
+private:
+    VertexList vertices;
+    
+public:
+    // vs stands for vertices.
+    Hyperedge(const vector<int>& vs) : vertices(vs.data(), vs.data() + vs.size()){
+    };
+    
+    // The vertices in [first, last), e.g. a Hyperedge in the flat form of parse_hypergraph.
+    Hyperedge(const int* first, const int* last) : vertices(first, last){
+    };
+    
+    Hyperedge(string str){
+        int s = str.length();
+        int pos_pre = 1;
+        
+        if ((str[0] == '{') && (str[s-1] == '}')){
+            for (int pos = 1; pos < s-1; pos++)
+                if ((str[pos] == ',') || (pos == s-2)){
+                    vertices.push_back(stoi(str.substr(pos_pre, pos-pos_pre+1)));
+                    pos_pre = pos + 1;
+                }
+        }
+            
+    };
+    
+    // empty constructor
+    Hyperedge(){
+    };
+    
+    // Get vertex at position i.
+    int get(int i) const{
+        return vertices[i];
+    };
+    
+    const VertexList& get_vertices() const{
+        return vertices;
+    };
+    
+    // Remove the vertices.
+    void clear(){
+        vertices.clear();
+    };
+    
+    void append(int v){
+        this->vertices.push_back(v);
+    };
+    
+    void append(const Hyperedge& he){
+        this->vertices.reserve(this->size() + he.size());
+        for (int u : he.vertices)
+            this->vertices.push_back(u);
+    };
+    
+    // Returns true if u is an element of Hyperedge, false otherwise.
+    bool is_elem(int u) const{
+        return contains_vertex(vertices.data(), vertices.size(), u);
+    };
+    
+    // Returns how many times the vertex `v` appears in the Hypergraph
+    int frequency_of_vertex(int v) const{
+        int c = 0;
+        for (int u : vertices)
+            if (u == v)
+                c++;
+        
+        return c;
+    };
+    
+    int size() const{
+        return vertices.size();
+    };
+    
+    // Returns a sorted list of unique elements of Hyperedge.
+    Hyperedge unique_vertices() const{
+        Hyperedge he = *this;
+        
+        sort(he.vertices.begin(), he.vertices.end());
+        he.vertices.resize(unique(he.vertices.begin(), he.vertices.end()) - he.vertices.begin());
+        
+        return he;
+    };
+    
+    // Returns true if there is nonzero intersection, false otherwise.
+    bool does_intersect_with(const Hyperedge& he) const{
+        return intersect_vertices(vertices.data(), vertices.size(), he.vertices.data(), he.vertices.size());
+    };
+    
+    Hyperedge map_via_rule(const Rule& r) const{
+        Hyperedge he;
+        
+        he.vertices.reserve(this->size());
+        for (int i : this->vertices)
+            he.vertices.push_back(r.at(i));
+        
+        return he;
+    };
+    
+    // Apply rule to "this" Hyperedge and check equality with he2. The image is compared vertex
+    // by vertex, so nothing is allocated.
+    bool is_isomorph_to_via_rule(const Rule& r, const Hyperedge& he2) const{
+        const int s = vertices.size();
+        
+        if (s != he2.size())
+            return false;
+        
+        for (int i = 0; i < s; i++)
+            if (r.at(vertices[i]) != he2.vertices[i])
+                return false;
+        
+        return true;
+    };
+    
+    friend bool operator==(const Hyperedge& he1, const Hyperedge& he2);
+    friend bool operator!=(const Hyperedge& he1, const Hyperedge& he2);
+    
+    // Same as print, but returns the text.
+    string str() const{
+        string text = "{";
+        
+        for (int i = 0; i < vertices.size(); i++)
+            text += ((i > 0) ? "," : "") + to_string(vertices[i]);
+        
+        return text + "}";
+    };
+    
+    // If newline = false, endl is not printed at the end.
+    void print(bool newline = true) const{
         int s = vertices.size();
         
         cout << "{";
@@ -417,73 +1595,139 @@ bool operator!=(const Hyperedge& he1, const Hyperedge& he2){
     return he1.vertices != he2.vertices;
 }
 
+class FlatHypergraph;
+
+// The FlatHypergraph of a Hypergraph, built when a query first needs it (see
+// Hypergraph::flat_index). It is only a cache, so a copy starts empty.
+struct FlatIndexCache{
+    shared_ptr<const FlatHypergraph> index;
+    
+    FlatIndexCache(){
+    };
+    
+    FlatIndexCache(const FlatIndexCache&){
+    };
+    
+    FlatIndexCache& operator=(const FlatIndexCache&){
+        index.reset();
+        return *this;
+    };
+};
+
 class Hypergraph{
     
 private:
     vector<Hyperedge> hg;
     
+    mutable FlatIndexCache flat;
+    
+    // The value of invariant_hash, if it was given by set_invariant_hash. It is forgotten when
+    // the Hyperedges change.
+    unsigned long long known_hash = 0;
+    bool has_known_hash = false;
+    
+    void forget_derived(){
+        has_known_hash = false;
+        flat.index.reset();
+    };
+    
 public:
     // Default value for Hypergraph is an empty list.
-    Hypergraph(vector<Hyperedge> hes){
-        this->hg = hes;
+    Hypergraph(const vector<Hyperedge>& hes) : hg(hes){
     };
     
+    // Takes over the Hyperedges of hes without copying them.
+    Hypergraph(vector<Hyperedge>&& hes) : hg(move(hes)){
+    };
+    
+    // If str is malformed, the Hypergraph holds the Hyperedges that could be read before the error.
     Hypergraph(string str){
-        int s = str.length();
-        int pos_pre, pos;
+        vector<int> vertices;
+        vector<int> offsets(1, 0);
+        const char* error_pos;
+        const char* error_msg;
         
-        if ((str[0] == '{') && (str[s-1] == '}')){
-            for (int pos_pre = 1; pos_pre < s-1; pos_pre++){
-                if (str[pos_pre] == '{'){
-                    pos = pos_pre;
-                    do{
-                        pos++;
-                    }while(str[pos] != '}');
-                    this->hg.push_back(Hyperedge(str.substr(pos_pre, pos - pos_pre + 1)));
-                    pos_pre = pos;
-                }
-            }
-        }
+        parse_hypergraph(str.data(), str.data() + str.size(), vertices, offsets, error_pos, error_msg);
+        this->assign(vertices, offsets);
+    };
+    
+    // Hyperedges in the flat form of parse_hypergraph.
+    Hypergraph(const vector<int>& vertices, const vector<int>& offsets){
+        this->assign(vertices, offsets);
+    };
+    
+    // Replaces the Hyperedges by the ones in the flat form of parse_hypergraph.
+    void assign(const vector<int>& vertices, const vector<int>& offsets){
+        const int e = offsets.size() - 1;
         
+        this->forget_derived();
+        hg.clear();
+        hg.reserve(e);
+        for (int i = 0; i < e; i++)
+            hg.push_back(Hyperedge(vertices.data() + offsets[i], vertices.data() + offsets[i+1]));
     };
     
     // empty constructor
     Hypergraph(){
     };
     
-    void append(Hyperedge he){
+    void append(const Hyperedge& he){
+        this->forget_derived();
         this->hg.push_back(he);
     };
     
-    Hyperedge unique_vertices(){
-        int s = this->size();
-        
-        Hyperedge he;
-        
-        if (s == 0)
-            return he;
-        
-        he = hg[0];
+    void append(Hyperedge&& he){
+        this->forget_derived();
+        this->hg.push_back(move(he));
+    };
+    
+    // Reserves room for s Hyperedges.
+    void reserve(int s){
+        this->hg.reserve(s);
+    };
+    
+    Hyperedge unique_vertices() const{
+        vector<int> vs;
+        long long low = INT_MAX, high = INT_MIN, total = 0;
         
-        if (s >= 1)
-            for(int i = 1; i < s; i++)
-                he.append(hg[i]);
+        for (const Hyperedge& he : hg)
+            for (int u : he.get_vertices()){
+                low = min(low, (long long) u);
+                high = max(high, (long long) u);
+                total++;
+            }
         
-        he = he.unique_vertices();
+        // Dense vertices are collected in a Bitset, in linear time; the others are sorted.
+        if ((total > 0) && (high - low < 4 * total + 64)){
+            Bitset seen(high - low + 1);
+            for (const Hyperedge& he : hg)
+                for (int u : he.get_vertices())
+                    seen.set(u - low);
+            vs.reserve(seen.count());
+            seen.for_each([&](int x){
+                vs.push_back(low + x);
+            });
+        }
+        else{
+            for (const Hyperedge& he : hg)
+                vs.insert(vs.end(), he.get_vertices().begin(), he.get_vertices().end());
+            sort(vs.begin(), vs.end());
+            vs.erase(unique(vs.begin(), vs.end()), vs.end());
+        }
         
-        return he;
+        return Hyperedge(vs);
     };
     
+    // The index of the Hyperedges by vertex, which the queries below run on, so that they cost
+    // time proportional to the degree instead of the number of Hyperedges. It is built the first
+    // time it is needed and kept until the Hyperedges change. Threads that need it at the same
+    // time may each build one, and one of them is kept.
+    shared_ptr<const FlatHypergraph> flat_index() const;
+    
     // Returns how many times the vertex `v` appears in the Hypergraph
-    int frequency_of_vertex(int v){
-        int c = 0;
-        for (Hyperedge he: hg)
-            c += he.frequency_of_vertex(v);
-        
-        return c;
-    };
+    int frequency_of_vertex(int v) const;
     
-    FrequencyDict frequency_of_vertices(){
+    FrequencyDict frequency_of_vertices() const{
         Hyperedge he = this->unique_vertices();
         int s = he.size();
         FrequencyDict f;
@@ -494,8 +1738,6 @@ public:
             u = he.get(i);
             freq = this->frequency_of_vertex(u);
             
-            vs.empty();
-            
             if (f.count(freq) > 0){
                 f.at(freq).push_back(u);
             }
@@ -503,23 +1745,16 @@ public:
                 f.insert(FrequencyDict::value_type(freq,vs));
                 f.at(freq).push_back(u);
             }
-            
+        
         }
         
         return f;
     };
     
     // Returns true if he is an elem of this->hg.
-    bool does_include(Hyperedge he2){
-        
-        for (Hyperedge he : hg)
-            if (he == he2)
-                return true;
-        
-        return false;
-    };
+    bool does_include(const Hyperedge& he2) const;
     
-    Hypergraph remove_hyperedge_once(Hyperedge he){
+    Hypergraph remove_hyperedge_once(const Hyperedge& he) const{
         int s = hg.size();
         int count = 0;
         vector<Hyperedge> hg2;
@@ -534,34 +1769,34 @@ public:
                 else
                     count++;
             }
-            
+        
         }
         
-        return Hypergraph(hg2);
+        return Hypergraph(move(hg2));
     };
     
     // New implementation: 22 December 2022, 15:43.
-    Hypergraph remove_hyperedge(Hyperedge he){
+    Hypergraph remove_hyperedge(const Hyperedge& he) const{
         int s = hg.size();
-        bool is_he_elem_of = false;
         vector<Hyperedge> hg2;
         
         for (int i = 0; i < s; i++)
             if (hg[i] != he)
                 hg2.push_back(hg[i]);
         
-        return Hypergraph(hg2);
+        return Hypergraph(move(hg2));
     };
     
-    int size(){
+    int size() const{
         return hg.size();
     };
     
     // Returns the list of length of Hyperedges in non-decreasing order.
-    vector<int> size_nub(){
+    vector<int> size_nub() const{
         vector<int> list;
         const int s = this->size();
         
+        list.reserve(s);
         // The length of each Hyperedge is added
         for (int i = 0; i < s; i++)
             list.push_back(hg[i].size());
@@ -573,22 +1808,28 @@ public:
     };
     
     // Get the Hyperedge that is located at index i.
-    Hyperedge get(int i){
+    const Hyperedge& get(int i) const{
         return hg[i];
     };
     
-    void union_with(Hypergraph hg2){
-        int s = hg2.size();
-        
-        if (s > 0)
-            for (int i = 0; i < s; i++)
-                this->append(hg2.get(i));
+    void union_with(const Hypergraph& hg2){
+        this->forget_derived();
+        this->hg.insert(this->hg.end(), hg2.hg.begin(), hg2.hg.end());
     };
     
-    Hypergraph map_via_rule(Rule r){
+    // Moves the Hyperedges of hg2 over instead of copying them.
+    void union_with(Hypergraph&& hg2){
+        this->forget_derived();
+        this->hg.insert(this->hg.end(), make_move_iterator(hg2.hg.begin()), make_move_iterator(hg2.hg.end()));
+        hg2.forget_derived();
+        hg2.hg.clear();
+    };
+    
+    Hypergraph map_via_rule(const Rule& r) const{
         Hypergraph hg2;
         
-        for (Hyperedge he : this->hg)
+        hg2.reserve(this->hg.size());
+        for (const Hyperedge& he : this->hg)
             hg2.append(he.map_via_rule(r));
         
         return hg2;
@@ -597,38 +1838,13 @@ public:
     friend bool operator==(const Hypergraph& hg1, const Hypergraph& hg2);
     friend bool operator!=(const Hypergraph& hg1, const Hypergraph& hg2);
     
-    Hypergraph neighborhood_of_vertex(int v){
-        Hypergraph hg2(this->hg);
-        
-        int s = hg.size();
-        
-        for(int i = 0; i < s; i++){
-            if (!hg2.hg.at(i).is_elem(v)){
-                hg2.hg.erase(hg2.hg.begin() + i);
-                i -= 1;
-                s -= 1;
-            }
-        }
-        
-        return hg2;
-    };
+    // The Hyperedges that contain v, in their order.
+    Hypergraph neighborhood_of_vertex(int v) const;
     
-    Hypergraph neighborhood_of_hyperedge(Hyperedge he){
-        Hypergraph hg2(this->hg);
-        
-        int s = hg.size();
-        
-        for(int i = 0; i < s; i++){
-            if (!hg2.hg[i].does_intersect_with(he)){
-                hg2.hg.erase(hg2.hg.begin() + i);
-                i -= 1;
-                s -= 1;
-            }
-        }
-        return hg2;
-    };
+    // The Hyperedges that have nonempty intersection with he2, in their order.
+    Hypergraph neighborhood_of_hyperedge(const Hyperedge& he2) const;
     
-    bool is_isomorph_to_via_rule(bool of_same_size, Rule r, Hypergraph hg2){
+    bool is_isomorph_to_via_rule(bool of_same_size, const Rule& r, const Hypergraph& hg2) const{
         // Preliminary checks if of_same_size = false
         if (of_same_size == false){
             vector<int> nub1;
@@ -659,77 +1875,318 @@ public:
             if (is_of_same_shape(f1,f2) == false)
                 return false;
         }
-            
-        Hyperedge he3;
         
-        for (Hyperedge he : hg){
-            he3 = he.map_via_rule(r);
-            if (hg2.size() == 0)
+        // The multiset of hg2 lives in a buffer of the thread that is reused from call to call.
+        thread_local EdgeMultiset edges2;
+        
+        hg2.edge_multiset(edges2);
+        
+        return this->is_isomorph_to_via_rule(r, edges2);
+    };
+    
+    // The Hyperedges of this Hypergraph as an EdgeMultiset.
+    void edge_multiset(EdgeMultiset& edges) const{
+        edges.clear();
+        for (const Hyperedge& he : hg)
+            edges.add(he.get_vertices().data(), he.size());
+    };
+    
+    // Apply r to each Hyperedge and match the image with a copy of it in edges2 that is not
+    // matched yet. edges2 is built once, by edge_multiset, for any number of rules; each check
+    // then costs one lookup per Hyperedge and allocates nothing.
+    bool is_isomorph_to_via_rule(const Rule& r, const EdgeMultiset& edges2) const{
+        thread_local vector<int> left;
+        thread_local vector<int> image;
+        int num_of_matched = 0;
+        
+        left = edges2.multiplicities();
+        for (const Hyperedge& he : hg){
+            if (num_of_matched == edges2.size())
                 return true;
-            else{
-                if (hg2.does_include(he3))
-                    hg2 = hg2.remove_hyperedge_once(he3);
-                else
-                    return false;
-            }
+            
+            image.clear();
+            for (int u : he.get_vertices())
+                image.push_back(r.at(u));
+            
+            int i = edges2.find(image.data(), image.size());
+            if ((i < 0) || (left[i] == 0))
+                return false;
+            left[i]--;
+            num_of_matched++;
         }
-
+        
         return true;
     };
     
-    bool is_isomorph_to(Hypergraph hg2){
-        vector<int> nub1;
-        vector<int> nub2;
+    // A 64-bit hash that does not depend on the labels of vertices nor on the order of Hyperedges.
+    // It is built from the number of Hyperedges, their arities, and for each vertex the histogram
+    // of (arity, position) of its occurrences, which also fixes its degree. Isomorphic Hypergraphs
+    // have the same hash. The histograms are summed in thread-local arrays indexed by the vertex
+    // if the vertices are dense, and by sorting the occurrences otherwise, so nothing is allocated
+    // once the arrays have grown. A hash given by set_invariant_hash is returned as it is.
+    unsigned long long invariant_hash() const{
+        if (has_known_hash)
+            return known_hash;
+        
+        unsigned long long h = mix_bits(hg.size());
+        long long low = INT_MAX, high = INT_MIN, total = 0;
+        
+        for (const Hyperedge& he : hg){
+            h += mix_bits(0x100000000ULL + he.size());
+            for (int u : he.get_vertices()){
+                low = min(low, (long long) u);
+                high = max(high, (long long) u);
+                total++;
+            }
+        }
+        
+        unsigned long long vertex_part = 0;
+        long long num_of_vertices = 0;
+        
+        if ((total > 0) && (high - low < 4 * total + 64)){
+            thread_local vector<unsigned long long> sums;
+            thread_local vector<int> counts;
+            
+            if ((long long) sums.size() < high - low + 1){
+                sums.resize(high - low + 1, 0);
+                counts.resize(high - low + 1, 0);
+            }
+            for (const Hyperedge& he : hg){
+                const int a = he.size();
+                for (int p = 0; p < a; p++){
+                    sums[he.get(p) - low] += mix_bits((unsigned long long) a << 32 | p);
+                    counts[he.get(p) - low]++;
+                }
+            }
+            
+            // Each vertex is taken once, and its entries are cleared for the next call.
+            for (const Hyperedge& he : hg)
+                for (int u : he.get_vertices())
+                    if (counts[u - low] > 0){
+                        vertex_part += mix_bits(sums[u - low]);
+                        num_of_vertices++;
+                        sums[u - low] = 0;
+                        counts[u - low] = 0;
+                    }
+        }
+        else{
+            thread_local vector<pair<int, unsigned long long> > occurrences;
+            
+            occurrences.clear();
+            for (const Hyperedge& he : hg){
+                const int a = he.size();
+                for (int p = 0; p < a; p++)
+                    occurrences.push_back(make_pair(he.get(p), mix_bits((unsigned long long) a << 32 | p)));
+            }
+            sort(occurrences.begin(), occurrences.end());
+            
+            for (int i = 0; i < (int) occurrences.size(); ){
+                unsigned long long sum = 0;
+                int j = i;
+                for (; (j < (int) occurrences.size()) && (occurrences[j].first == occurrences[i].first); j++)
+                    sum += occurrences[j].second;
+                vertex_part += mix_bits(sum);
+                num_of_vertices++;
+                i = j;
+            }
+        }
+        
+        h ^= mix_bits(0x200000000ULL + num_of_vertices);
+        return h + vertex_part;
+    };
+    
+    // Makes invariant_hash return h, which must be the value it would compute (see Tree).
+    void set_invariant_hash(unsigned long long h){
+        known_hash = h;
+        has_known_hash = true;
+    };
+    
+    bool is_isomorph_to(const Hypergraph& hg2) const{
+        Rule mapping;
+        
+        return this->is_isomorph_to(hg2, mapping);
+    };
+    
+    // The vertices in mapping are tried first to be mapped as in mapping, which is useful when
+    // a similar pair of Hypergraphs was compared before. If the Hypergraphs are isomorphic,
+    // mapping is replaced by the vertex mapping that was found.
+    bool is_isomorph_to(const Hypergraph& hg2, Rule& mapping) const{
+        hot_counters().iso_calls++;
         
         // Just to make sure that each have the same number of Hyperedges.
-        if (this->size() != hg2.size())
+        if (this->size() != hg2.size()){
+            hot_counters().iso_rejected_by_shape++;
+            return false;
+        }
+        
+        // Most of the pairs are told apart here, before anything is allocated.
+        if (this->invariant_hash() != hg2.invariant_hash()){
+            hot_counters().iso_rejected_by_hash++;
             return false;
+        }
         
         vector<int> uv1 = this->unique_vertices().get_vertices();
         vector<int> uv2 = hg2.unique_vertices().get_vertices();
+        const int n = uv1.size();
+        
+        // If two Hypergraphs do not have the same number of vertices,
+        // they cannot be isomorphic.
+        if (uv1.size() != uv2.size()){
+            hot_counters().iso_rejected_by_shape++;
+            return false;
+        }
+        
+        // We make a simple test. If this fails, we need to work more.
+        if (this->size_nub() != hg2.size_nub()){
+            hot_counters().iso_rejected_by_shape++;
+            return false;
+        }
+        
+        // From here on vertices are referred to by their indices, and the tables of vertices
+        // are arrays.
+        vector<vector<int> > edges1 = this->indexed_edges(uv1);
+        vector<vector<int> > edges2 = hg2.indexed_edges(uv2);
+        
+        // The vertices must have the same frequencies.
+        vector<int> freq1(n, 0), freq2(n, 0);
+        for (auto& e : edges1)
+            for (int x : e)
+                freq1[x]++;
+        for (auto& e : edges2)
+            for (int x : e)
+                freq2[x]++;
+        sort(freq1.begin(), freq1.end());
+        sort(freq2.begin(), freq2.end());
+        if (freq1 != freq2){
+            hot_counters().iso_rejected_by_shape++;
+            return false;
+        }
         
-        // If two Hypergraphs do not have the same number of vertices,
-        // they cannot be isomorphic.
-        if (uv1.size() != uv2.size())
+        // The frequency classes are split further by refined vertex colors.
+        vector<int> color1, color2;
+        if (!refine_vertex_colors(edges1, n, edges2, n, color1, color2)){
+            hot_counters().iso_rejected_by_shape++;
             return false;
+        }
         
-        nub1 = this->size_nub();
-        nub2 = hg2.size_nub();
+        hot_counters().iso_full_checks++;
         
-        // We make a simple test. If this fails, we need to work more.
-        if (nub1 != nub2)
-            return false;
+        // Now, if the previous tests are passed we search for a mapping of vertices with the
+        // same color. The mapping is grown one vertex at a time, so the permutations
+        // are never listed.
+        return search_mapping_between(edges1, color1, uv1, edges2, color2, uv2, mapping);
+    };
+    
+    // Searches for an automorphism of this Hypergraph that moves some vertex, within budget (see
+    // AUTOMORPHISM_SEARCH_BUDGET). An automorphism keeps the refined colors, and its inverse is
+    // one too, so only pairs u < v of the same color are tried: u and v are given a new color,
+    // and unless the colors then refine differently a mapping taking u to v is searched for.
+    // Returns true, with automorphism set, if one is found; false if there is none or the budget
+    // ran out.
+    bool find_moving_automorphism(Rule& automorphism, long long budget) const{
+        vector<int> uv = this->unique_vertices().get_vertices();
+        vector<vector<int> > edges = this->indexed_edges(uv);
+        const int n = uv.size();
+        vector<vector<int> > no_edges;
+        vector<int> color, no_color;
+        
+        refine_vertex_colors(edges, n, no_edges, 0, color, no_color);
+        
+        int num_of_colors = 0;
+        for (int c : color)
+            num_of_colors = max(num_of_colors, c + 1);
+        vector<vector<int> > classes(num_of_colors);
+        for (int x = 0; x < n; x++)
+            classes[color[x]].push_back(x);
+        
+        for (auto& cls : classes)
+            for (int i = 0; i < (int) cls.size(); i++)
+                for (int j = i+1; j < (int) cls.size(); j++){
+                    // A refinement costs about as much as n vertex mappings.
+                    budget -= n;
+                    if (budget <= 0)
+                        return false;
+                    
+                    vector<int> color1 = color, color2 = color;
+                    color1[cls[i]] = num_of_colors;
+                    color2[cls[j]] = num_of_colors;
+                    if (!refine_vertex_colors(edges, n, edges, n, color1, color2, true))
+                        continue;
+                    
+                    automorphism.clear();
+                    if (search_mapping_between(edges, color1, uv, edges, color2, uv, automorphism, &budget))
+                        return true;
+                }
         
-        FrequencyDict f1 = this->frequency_of_vertices();
-        FrequencyDict f2 = hg2.frequency_of_vertices();
+        return false;
+    };
+    
+    // The Hyperedges on the indices of their vertices in uv, the sorted unique vertices.
+    vector<vector<int> > indexed_edges(const vector<int>& uv) const{
+        VertexIndex index(uv);
+        vector<vector<int> > edges(hg.size());
         
-        if (is_of_same_shape(f1,f2) == false)
-            return false;
+        for (int i = 0; i < (int) hg.size(); i++){
+            edges[i].reserve(hg[i].size());
+            for (int u : hg[i].get_vertices())
+                edges[i].push_back(index(u));
+        }
         
-        // Now, if the previous tests are passed we can consider permutation of vertices with the
-        // same frequency counts.
-        vector<Rule> all_rules = all_permutations_of_two_dicts(f1, f2);
+        return edges;
+    };
+    
+    // The same Hypergraph on the vertices 0, ..., n-1, in the order of the vertices, so that
+    // tables of vertices can be arrays indexed by the vertex. labels[x] is the vertex that
+    // became x.
+    Hypergraph densely_relabeled(vector<int>& labels) const{
+        labels = this->unique_vertices().get_vertices();
+        vector<vector<int> > edges = this->indexed_edges(labels);
+        Hypergraph dense;
         
-	// The number of threads is define in the main file.
-	// Maybe there is an overhead in initializing this here.
-	//omp_set_num_threads(NUM_THREADS);
-
-	const int num_of_rules = all_rules.size();
-	volatile bool is_iso = false;
-
-        #pragma omp parallel for shared(is_iso)
-	  for (int i = 0; i < num_of_rules; i++)
-	    {
-	    if (is_iso == false)
-	      if (this->is_isomorph_to_via_rule(true, all_rules[i], hg2))
-		is_iso = true;
-             }
-	
-        return is_iso;
+        dense.reserve(edges.size());
+        for (auto& e : edges)
+            dense.append(Hyperedge(e));
+        
+        return dense;
+    };
+    
+    // Canonical form of this Hypergraph, see CanonicalForm. If the Hypergraph is so symmetric that
+    // the search exceeds CANONICAL_SEARCH_BUDGET, found is false.
+    CanonicalForm canonical_form() const{
+        vector<int> uv = this->unique_vertices().get_vertices();
+        const int n = uv.size();
+        vector<vector<int> > edges = this->indexed_edges(uv);
+        CanonicalForm cf;
+        int budget = CANONICAL_SEARCH_BUDGET;
+        
+        search_canonical_labeling(edges, n, vector<int>(n, 0), cf, budget);
+        if (budget < 0)
+            cf.found = false;
+        if (!cf.found)
+            return cf;
+        
+        cf.num_of_vertices = n;
+        cf.hash = hash_of_edges(cf.edges, n);
+        
+        return cf;
+    };
+    
+    // Same as print, but returns the text.
+    string str() const{
+        int s = hg.size();
+        string text = "{";
+        
+        for (int i = 0; i < s; i++){
+            text += hg[i].str();
+            if (i < s-1)
+                text += ",";
+        }
+        
+        return text + "}";
     };
     
     // If newline = false, endl is not printed at the end.
-    void print(bool newline = true){
+    void print(bool newline = true) const{
         int s = hg.size();
         
         cout << "{";
@@ -754,162 +2211,735 @@ public:
 //    return hg1.hg != hg2.hg;
 //}
 
-class Tree{
+// At most this many words (32 MB) are spent on the incidence masks of a FlatHypergraph.
+const long long INCIDENCE_MASK_BUDGET = 1LL << 22;
+
+// Compact storage of a Hypergraph: the vertices of all Hyperedges lie in one array, and
+// Hyperedge i is vertices[offsets[i]] ... vertices[offsets[i+1]-1]. Vertices are indexed by
+// their position in the sorted list of unique vertices, and for each vertex the Hyperedges
+// that contain it are kept in the same way (incidence, incidence_offsets). Hence neighborhood
+// queries cost time proportional to the degree, not to the number of Hyperedges.
+class FlatHypergraph{
+    
 private:
-    Hyperedge node;
-    vector<Tree> leaves;
+    vector<int> vertices;
+    vector<int> offsets;
+    vector<int> labels;
+    vector<int> incidence;
+    vector<int> incidence_offsets;
     
-public:
+    // The same incidence as Bitsets of Hyperedges, mask_words words for each vertex, if they
+    // fit in INCIDENCE_MASK_BUDGET words. The neighborhood of a Hyperedge is then the union of
+    // the masks of its vertices, unless their incidence lists are much shorter than the masks.
+    vector<uint64_t> incidence_masks;
+    int mask_words = 0;
+    
+    // True if the vertices are 0, ..., n-1, which are then their own indices.
+    bool dense = false;
     
-    // Neighborhood Tree of Hyperedge he.
-    Tree(Hypergraph hg, Hyperedge he){
-        node = he;
+    // Hyperedges that are equal have the same class.
+    vector<int> edge_class;
+    map<vector<int>, int> classes;
+    
+public:
+    FlatHypergraph(const Hypergraph& hg){
+        const int e = hg.size();
+        
+        offsets.push_back(0);
+        for (int i = 0; i < e; i++){
+            vector<int> vs = hg.get(i).get_vertices();
+            vertices.insert(vertices.end(), vs.begin(), vs.end());
+            offsets.push_back(vertices.size());
+            
+            auto it = classes.find(vs);
+            if (it == classes.end())
+                it = classes.insert(map<vector<int>, int>::value_type(vs, classes.size())).first;
+            edge_class.push_back(it->second);
+        }
+        
+        labels = vertices;
+        sort(labels.begin(), labels.end());
+        labels.erase(unique(labels.begin(), labels.end()), labels.end());
+        dense = labels.empty() || ((labels.front() == 0) && (labels.back() == (int) labels.size() - 1));
+        
+        // We count the incident Hyperedges of each vertex, then fill them in. A Hyperedge that
+        // contains a vertex more than once is listed once.
+        const int n = labels.size();
+        vector<int> last(n, -1);
+        incidence_offsets.assign(n+1, 0);
+        for (int i = 0; i < e; i++)
+            for (int j = offsets[i]; j < offsets[i+1]; j++){
+                int x = this->index_of_vertex(vertices[j]);
+                if (last[x] != i){
+                    last[x] = i;
+                    incidence_offsets[x+1]++;
+                }
+            }
+        for (int x = 0; x < n; x++)
+            incidence_offsets[x+1] += incidence_offsets[x];
+        
+        vector<int> fill(incidence_offsets.begin(), incidence_offsets.end()-1);
+        incidence.resize(incidence_offsets[n]);
+        last.assign(n, -1);
+        for (int i = 0; i < e; i++)
+            for (int j = offsets[i]; j < offsets[i+1]; j++){
+                int x = this->index_of_vertex(vertices[j]);
+                if (last[x] != i){
+                    last[x] = i;
+                    incidence[fill[x]++] = i;
+                }
+            }
         
-        if (hg.size()){
-            // hg_neigh is the set of all hyperedges that have nonempty intersection with he.
-            Hypergraph hg_neigh = hg.neighborhood_of_hyperedge(he);
-            Hypergraph hg_copy = hg;
-            // We remove he.
-            hg_neigh = hg_neigh.remove_hyperedge(he);
-            hg_copy = hg_copy.remove_hyperedge(he);
-            int s = hg_neigh.size();
-            for (int i = 0; i < s; i++)
-                this->leaves.push_back(Tree(hg_copy, hg_neigh.get(i)));
+        mask_words = (e + 63) / 64;
+        if ((long long) n * mask_words <= INCIDENCE_MASK_BUDGET){
+            incidence_masks.assign((size_t) n * mask_words, 0);
+            for (int x = 0; x < n; x++)
+                for (int k = incidence_offsets[x]; k < incidence_offsets[x+1]; k++)
+                    incidence_masks[(size_t) x * mask_words + (incidence[k] >> 6)] |= 1ULL << (incidence[k] & 63);
         }
     };
     
-    // This is the whole Tree that is associated with the Hypergraph.
-    Tree(Hypergraph hg){
-        Hyperedge he = hg.unique_vertices();
-        Hyperedge he_iter;
-        int s = he.size();
-        
-        for (int i = 0; i < s; i++){
-            he_iter.append(he.get(i));
-            leaves.push_back(Tree(hg, he_iter));
-            he_iter.clear();
-        }
+    // Empty constructor
+    FlatHypergraph(){
+        offsets.push_back(0);
     };
     
-    // Empty constructor.
-    Tree(){
+    // Number of Hyperedges.
+    int size() const{
+        return edge_class.size();
     };
     
-    Hyperedge get_node(){
-        return node;
+    int num_of_vertices() const{
+        return labels.size();
     };
     
-    Tree get_leave(int i){
-        return leaves[i];
+    int arity(int i) const{
+        return offsets[i+1] - offsets[i];
     };
     
-    int size_of_leaves(){
-        return leaves.size();
+    // Pointer to the first vertex of Hyperedge i.
+    const int* edge_begin(int i) const{
+        return vertices.data() + offsets[i];
     };
     
-    // Returns the Tree from whole_tree that is a Tree beginning with node {u}
-    Tree neighborhood_of_vertex(int u){
-        Hyperedge he;
-        he.append(u);
+    Hyperedge get(int i) const{
+        return Hyperedge(vertices.data() + offsets[i], vertices.data() + offsets[i+1]);
+    };
+    
+    int class_of_hyperedge(int i) const{
+        return edge_class[i];
+    };
+    
+    // Returns the class of he, or -1 if he is not a Hyperedge of this Hypergraph.
+    int class_of(const Hyperedge& he) const{
+        auto it = classes.find(he.get_vertices());
+        
+        if (it == classes.end())
+            return -1;
+        return it->second;
+    };
+    
+    // Returns the index of vertex u among the unique vertices, or -1 if u does not appear.
+    int index_of_vertex(int u) const{
+        if (dense)
+            return ((u >= 0) && (u < (int) labels.size())) ? u : -1;
         
-        for (auto leaf : leaves)
-            if (leaf.get_node() == he)
-                return leaf;
+        auto it = lower_bound(labels.begin(), labels.end(), u);
         
-        // If the condition is not met, return an empty Tree
-        return Tree();
+        if ((it == labels.end()) || (*it != u))
+            return -1;
+        return it - labels.begin();
     };
     
-    int depth(){
-        int d = 0;
-        int s = leaves.size();
-        vector<int> leave_depth;
+    vector<int> unique_vertices() const{
+        return labels;
+    };
+    
+    // Returns how many times the vertex `v` appears in the Hypergraph
+    int frequency_of_vertex(int v) const{
+        int x = this->index_of_vertex(v);
+        int c = 0;
         
-        if (s == 0)
+        if (x < 0)
             return 0;
-        else{
-            for (int i = 0; i < s; i++)
-                leave_depth.push_back(leaves[i].depth());
+        
+        for (int k = incidence_offsets[x]; k < incidence_offsets[x+1]; k++){
+            int i = incidence[k];
+            for (int j = offsets[i]; j < offsets[i+1]; j++)
+                if (vertices[j] == v)
+                    c++;
         }
         
-        int m = max_vec_int(leave_depth);
-        return m + 1;
+        return c;
     };
     
-    // We suppose the head node in the Tree is just a "vertex" like {1}
-    Hypergraph neighborhood_at_depth(int d){
-        Hypergraph hg;
+    // Returns true if he is a Hyperedge of this Hypergraph.
+    bool does_include(const Hyperedge& he) const{
+        return this->class_of(he) >= 0;
+    };
+    
+    // Indices of Hyperedges that contain v, in increasing order.
+    vector<int> neighborhood_of_vertex(int v) const{
+        int x = this->index_of_vertex(v);
+        
+        if (x < 0)
+            return vector<int>();
         
-        if (d < 0){
-            cout << "Error: Tree depth cannot be negative!" << endl;
-            return hg;
+        return vector<int>(incidence.begin() + incidence_offsets[x], incidence.begin() + incidence_offsets[x+1]);
+    };
+    
+    // Sets ids to the indices of Hyperedges that have nonempty intersection with the Hyperedge of
+    // the vertices in [first, last), in increasing order. ids is the caller's buffer, so nothing
+    // is allocated once it has grown.
+    void neighborhood_of_hyperedge(const int* first, const int* last, vector<int>& ids) const{
+        thread_local vector<int> xs;
+        int listed = 0;
+        
+        ids.clear();
+        xs.clear();
+        for (const int* u = first; u < last; u++){
+            int x = this->index_of_vertex(*u);
+            if (x >= 0){
+                xs.push_back(x);
+                listed += incidence_offsets[x+1] - incidence_offsets[x];
+            }
         }
         
-        int max_depth = this->depth();
+        if (!incidence_masks.empty() && (mask_words <= listed)){
+            thread_local Bitset neighbors;
+            
+            neighbors.assign(this->size());
+            for (int x : xs)
+                bits_or(neighbors.data(), incidence_masks.data() + (size_t) x * mask_words, mask_words);
+            neighbors.for_each([&](int i){
+                ids.push_back(i);
+            });
+            
+            return;
+        }
         
-        // Just to make sure that we do not go beyond the Tree.
-        if (d > max_depth)
-            d = max_depth;
+        for (int x : xs)
+            ids.insert(ids.end(), incidence.begin() + incidence_offsets[x], incidence.begin() + incidence_offsets[x+1]);
         
-        if (d == 0){
-            hg.append(node);
-            return hg;
-        }
-        else{
-            for (Tree t : leaves)
-                hg.union_with(t.neighborhood_at_depth(d-1));
-        }
-        return hg;
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
     };
     
-    // We suppose the head node in the Tree is just a "vertex" like {1}
-    Hypergraph neighborhood_down_to_depth(int d){
+    void neighborhood_of_hyperedge(const Hyperedge& he, vector<int>& ids) const{
+        this->neighborhood_of_hyperedge(he.get_vertices().begin(), he.get_vertices().end(), ids);
+    };
+    
+    // The Hypergraph made of the Hyperedges with given indices.
+    Hypergraph sub_hypergraph(const vector<int>& ids) const{
         Hypergraph hg;
         
-        int max_depth = this->depth();
+        hg.reserve(ids.size());
+        for (int i : ids)
+            hg.append(this->get(i));
         
-        // Just to make sure that we do not go beyond the Tree.
-        if (d > max_depth)
-            d = max_depth;
+        return hg;
+    };
+};
+
+shared_ptr<const FlatHypergraph> Hypergraph::flat_index() const{
+    shared_ptr<const FlatHypergraph> index = atomic_load(&flat.index);
+    
+    if (index == nullptr){
+        index = make_shared<const FlatHypergraph>(*this);
+        atomic_store(&flat.index, index);
+    }
+    
+    return index;
+}
+
+int Hypergraph::frequency_of_vertex(int v) const{
+    return this->flat_index()->frequency_of_vertex(v);
+}
+
+bool Hypergraph::does_include(const Hyperedge& he2) const{
+    return this->flat_index()->does_include(he2);
+}
+
+Hypergraph Hypergraph::neighborhood_of_vertex(int v) const{
+    shared_ptr<const FlatHypergraph> index = this->flat_index();
+    
+    return index->sub_hypergraph(index->neighborhood_of_vertex(v));
+}
+
+Hypergraph Hypergraph::neighborhood_of_hyperedge(const Hyperedge& he2) const{
+    shared_ptr<const FlatHypergraph> index = this->flat_index();
+    thread_local vector<int> ids;
+    
+    index->neighborhood_of_hyperedge(he2, ids);
+    return index->sub_hypergraph(ids);
+}
+
+class Tree;
+
+// A node of a Tree and everything below it. It is only a position in the Tree, so it is cheap
+// to pass around, and it stays valid as long as the Tree is neither changed nor moved.
+class TreeView{
+    
+private:
+    Tree* tree;
+    int k;
+    
+    void append_neighborhood_at_depth(int node, int d, Hypergraph& hg);
+    
+public:
+    TreeView(Tree* t, int node){
+        tree = t;
+        k = node;
+    };
+    
+    Hyperedge get_node();
+    TreeView get_leave(int i);
+    int size_of_leaves();
+    TreeView neighborhood_of_vertex(int u);
+    int depth();
+    int level_size(int d);
+    unsigned long long invariant_hash(int d);
+    Hypergraph neighborhood_at_depth(int d);
+    Hypergraph neighborhood_down_to_depth(int d);
+    void print(string mode = "");
+};
+
+// The nodes of a Tree are kept in one array. The children of a node are consecutive, and a
+// node refers to its Hyperedge by its index in the FlatHypergraph of the Tree. Nodes whose
+// Hyperedge is not in the Hypergraph (the root, and the vertices below the root of the whole
+// Tree) refer to extra_edges by negative indices.
+struct TreeNode{
+    int edge;
+    int first_child;
+    int num_of_children;
+    
+    // Depth of the subtree, and the offset of its level sizes: level_sizes[levels + d] is the
+    // number of Hyperedges in neighborhood_at_depth(d), for 0 <= d <= depth.
+    int depth;
+    int levels;
+};
+
+class Tree{
+    
+    friend class TreeView;
+    
+private:
+    // The FlatHypergraph may be shared by several Trees of the same Hypergraph, which only read it.
+    shared_ptr<const FlatHypergraph> fh;
+    vector<Hyperedge> extra_edges;
+    vector<TreeNode> nodes;
+    vector<int> level_sizes;
+    
+    // level_hashes[levels + d] is the invariant_hash of neighborhood_down_to_depth(d) of a node,
+    // set for all d at once the first time it is needed (see TreeView::invariant_hash).
+    vector<unsigned long long> level_hashes;
+    vector<once_flag> hashed;
+    
+    // Node with an empty Hyperedge and no children, returned when nothing is found.
+    int empty_node;
+    
+    // True for the whole Tree of a Hypergraph, whose root has a child {u} for each vertex u,
+    // in increasing order.
+    bool is_whole = false;
+    
+    // Adds a node without children and returns its index. edge is as in TreeNode.
+    int add_node(int edge){
+        TreeNode t;
+        t.edge = edge;
+        t.first_child = nodes.size();
+        t.num_of_children = 0;
+        t.depth = 0;
+        t.levels = -1;
+        nodes.push_back(t);
+        
+        return nodes.size() - 1;
+    };
+    
+    int add_extra_edge(Hyperedge&& he){
+        extra_edges.push_back(move(he));
+        return -(int) extra_edges.size();
+    };
+    
+    Hyperedge edge_of(int k){
+        int e = nodes[k].edge;
         
-        for (int i = 1; i <= d; i++)
-            hg.union_with(this->neighborhood_at_depth(i));
+        return (e >= 0) ? fh->get(e) : extra_edges[-e-1];
+    };
+    
+    // The vertices of the Hyperedge of node k, without copying them: arity of them from the
+    // returned pointer on.
+    const int* vertices_of(int k, int& arity) const{
+        int e = nodes[k].edge;
         
-        return hg;
+        if (e >= 0){
+            arity = fh->arity(e);
+            return fh->edge_begin(e);
+        }
+        arity = extra_edges[-e-1].size();
+        return extra_edges[-e-1].get_vertices().data();
     };
     
-    void print(string mode = ""){
+    // Sets the depth and the level sizes of node k from its children, which must be complete.
+    void set_depth_and_level_sizes(int k){
+        int depth = 0;
+        const int first = nodes[k].first_child;
+        const int last = first + nodes[k].num_of_children;
         
-        int s = leaves.size();
+        for (int c = first; c < last; c++)
+            depth = max(depth, nodes[c].depth + 1);
         
-        if (mode == ""){
-            cout << "Node: ";
-            node.print();
-            
-            for (int i = 0; i < s; i++){
-                for (int j = 0; j < s; j++)
-                    cout << "---";
-                leaves[i].print();
-            }
+        // The sizes are summed in place at the end of level_sizes.
+        const int levels = level_sizes.size();
+        level_sizes.resize(levels + depth + 1, 0);
+        
+        // A leaf that is shallower than the requested depth counts at every deeper level.
+        level_sizes[levels] = 1;
+        for (int c = first; c < last; c++)
+            for (int d = 1; d <= depth; d++)
+                level_sizes[levels + d] += level_sizes[nodes[c].levels + min(d-1, nodes[c].depth)];
+        
+        nodes[k].depth = depth;
+        nodes[k].levels = levels;
+    };
+    
+    // Grows the Tree below node k, within the Hyperedges whose class is not removed.
+    // node_class is the class of the Hyperedge of k, or -1 if it is not a Hyperedge of fh.
+    // The children are the Hyperedges that intersect it, except the ones equal to it,
+    // and each of them is grown with it (and all its copies) removed. ids is a buffer shared
+    // by the whole growth, since the children are added before any of them is grown.
+    void grow(int k, vector<int>& removed, int node_class, vector<int>& ids){
+        int arity;
+        const int* vs = this->vertices_of(k, arity);
+        fh->neighborhood_of_hyperedge(vs, vs + arity, ids);
+        
+        if (node_class >= 0)
+            removed[node_class]++;
+        
+        // The children are added first, so that they are consecutive.
+        int first = nodes.size();
+        for (int i : ids){
+            int c = fh->class_of_hyperedge(i);
+            if ((removed[c] == 0) && (c != node_class))
+                this->add_node(i);
         }
-        if (mode == "Mathematica"){
-            cout << "Tree[";
-            node.print(false);
-            if (s == 0)
-                cout << ", {}]";
-            else{
-                cout << ", {";
-                for (int i = 0; i < s; i++){
-                    if (i > 0)
-                        cout << ", ";
-                    leaves[i].print("Mathematica");
+        int last = nodes.size();
+        nodes[k].first_child = first;
+        nodes[k].num_of_children = last - first;
+        
+        for (int c = first; c < last; c++)
+            this->grow(c, removed, fh->class_of_hyperedge(nodes[c].edge), ids);
+        
+        if (node_class >= 0)
+            removed[node_class]--;
+        
+        this->set_depth_and_level_sizes(k);
+    };
+    
+    // Adds the empty node and counts the nodes that were built.
+    void finish(){
+        hot_counters().tree_nodes += nodes.size();
+        hot_counters().max_tree_depth = max(hot_counters().max_tree_depth, (long long) nodes[0].depth);
+        
+        empty_node = this->add_node(this->add_extra_edge(Hyperedge()));
+        this->set_depth_and_level_sizes(empty_node);
+        
+        level_hashes.assign(level_sizes.size(), 0);
+        hashed = vector<once_flag>(nodes.size());
+    };
+    
+    // Calls f with each node of the neighborhood at depth d of node, in the order of
+    // TreeView::neighborhood_at_depth.
+    template <class F>
+    void for_each_node_at_depth(int node, int d, F& f){
+        const TreeNode& t = nodes[node];
+        
+        if (d > t.depth)
+            d = t.depth;
+        
+        if (d == 0)
+            f(node);
+        else
+            for (int c = t.first_child; c < t.first_child + t.num_of_children; c++)
+                this->for_each_node_at_depth(c, d-1, f);
+    };
+    
+    // Sets the level hashes of node k. The levels are added one at a time, and the histogram
+    // of each vertex (see Hypergraph::invariant_hash) is updated in a thread-local array indexed
+    // by the vertices of fh, so each depth costs the size of its level.
+    void set_level_hashes(int k){
+        thread_local vector<unsigned long long> sums;
+        thread_local vector<int> counts;
+        thread_local vector<int> touched;
+        const TreeNode& t = nodes[k];
+        unsigned long long edge_part = 0, vertex_part = 0;
+        long long num_of_edges = 0, num_of_vertices = 0;
+        
+        if ((int) sums.size() < fh->num_of_vertices()){
+            sums.resize(fh->num_of_vertices(), 0);
+            counts.resize(fh->num_of_vertices(), 0);
+        }
+        touched.clear();
+        
+        auto add_edge = [&](int node){
+            int a;
+            const int* vs = this->vertices_of(node, a);
+            
+            edge_part += mix_bits(0x100000000ULL + a);
+            num_of_edges++;
+            for (int p = 0; p < a; p++){
+                const int x = fh->index_of_vertex(vs[p]);
+                if (counts[x]++ == 0){
+                    touched.push_back(x);
+                    num_of_vertices++;
                 }
-                cout << "}]";
+                else
+                    vertex_part -= mix_bits(sums[x]);
+                sums[x] += mix_bits((unsigned long long) a << 32 | p);
+                vertex_part += mix_bits(sums[x]);
             }
-            
+        };
+        
+        for (int d = 0; d <= t.depth; d++){
+            if (d > 0)
+                this->for_each_node_at_depth(k, d, add_edge);
+            level_hashes[t.levels + d] = ((mix_bits(num_of_edges) + edge_part) ^ mix_bits(0x200000000ULL + num_of_vertices)) + vertex_part;
+        }
+        
+        for (int x : touched){
+            sums[x] = 0;
+            counts[x] = 0;
+        }
+    };
+    
+public:
+    
+    // Neighborhood Tree of Hyperedge he, in the Hypergraph of flat.
+    Tree(shared_ptr<const FlatHypergraph> flat, const Hyperedge& he) : fh(move(flat)){
+        vector<int> removed(fh->size(), 0);
+        vector<int> ids;
+        
+        this->add_node(this->add_extra_edge(Hyperedge(he)));
+        this->grow(0, removed, fh->class_of(he), ids);
+        this->finish();
+    };
+    
+    Tree(const Hypergraph& hg, const Hyperedge& he) : Tree(make_shared<const FlatHypergraph>(hg), he){
+    };
+    
+    // This is the whole Tree that is associated with the Hypergraph of flat.
+    Tree(shared_ptr<const FlatHypergraph> flat) : fh(move(flat)){
+        vector<int> removed(fh->size(), 0);
+        vector<int> ids;
+        vector<int> vs = fh->unique_vertices();
+        int s = vs.size();
+        
+        this->add_node(this->add_extra_edge(Hyperedge()));
+        nodes[0].first_child = 1;
+        nodes[0].num_of_children = s;
+        for (int i = 0; i < s; i++){
+            Hyperedge he;
+            he.append(vs[i]);
+            this->add_node(this->add_extra_edge(move(he)));
         }
         
+        for (int i = 0; i < s; i++)
+            this->grow(1 + i, removed, fh->class_of(extra_edges[i+1]), ids);
+        
+        this->set_depth_and_level_sizes(0);
+        is_whole = true;
+        this->finish();
+    };
+    
+    Tree(const Hypergraph& hg) : Tree(make_shared<const FlatHypergraph>(hg)){
+    };
+    
+    // Empty constructor.
+    Tree() : fh(make_shared<const FlatHypergraph>()){
+        this->add_node(this->add_extra_edge(Hyperedge()));
+        this->set_depth_and_level_sizes(0);
+        this->finish();
+    };
+    
+    TreeView root(){
+        return TreeView(this, 0);
+    };
+    
+    Hyperedge get_node(){
+        return this->root().get_node();
+    };
+    
+    TreeView get_leave(int i){
+        return this->root().get_leave(i);
+    };
+    
+    int size_of_leaves(){
+        return nodes[0].num_of_children;
+    };
+    
+    // Returns the subtree of the whole Tree that begins with node {u}, or an empty one.
+    TreeView neighborhood_of_vertex(int u){
+        if (!is_whole)
+            return this->root().neighborhood_of_vertex(u);
         
+        int x = fh->index_of_vertex(u);
+        return TreeView(this, (x >= 0) ? 1 + x : empty_node);
+    };
+    
+    int depth(){
+        return nodes[0].depth;
+    };
+    
+    // Returns the number of Hyperedges in neighborhood_at_depth(d).
+    int level_size(int d){
+        return this->root().level_size(d);
+    };
+    
+    Hypergraph neighborhood_at_depth(int d){
+        return this->root().neighborhood_at_depth(d);
+    };
+    
+    Hypergraph neighborhood_down_to_depth(int d){
+        return this->root().neighborhood_down_to_depth(d);
+    };
+    
+    void print(string mode = ""){
+        this->root().print(mode);
     };
 };
 
+Hyperedge TreeView::get_node(){
+    return tree->edge_of(k);
+}
+
+TreeView TreeView::get_leave(int i){
+    return TreeView(tree, tree->nodes[k].first_child + i);
+}
+
+int TreeView::size_of_leaves(){
+    return tree->nodes[k].num_of_children;
+}
+
+// Returns the subtree below this node that begins with node {u}, or an empty one.
+TreeView TreeView::neighborhood_of_vertex(int u){
+    Hyperedge he;
+    he.append(u);
+    
+    for (int i = 0; i < this->size_of_leaves(); i++)
+        if (this->get_leave(i).get_node() == he)
+            return this->get_leave(i);
+    
+    return TreeView(tree, tree->empty_node);
+}
+
+int TreeView::depth(){
+    return tree->nodes[k].depth;
+}
+
+// Returns the number of Hyperedges in neighborhood_at_depth(d).
+int TreeView::level_size(int d){
+    TreeNode& t = tree->nodes[k];
+    
+    return tree->level_sizes[t.levels + min(d, t.depth)];
+}
+
+// Same as neighborhood_down_to_depth(d).invariant_hash(), without building the neighborhood. The
+// hashes of all depths of a node are computed together, once, so comparing a neighborhood with
+// many others costs a lookup each.
+unsigned long long TreeView::invariant_hash(int d){
+    const TreeNode& t = tree->nodes[k];
+    
+    call_once(tree->hashed[k], [this](){
+        tree->set_level_hashes(k);
+    });
+    
+    return tree->level_hashes[t.levels + max(0, min(d, t.depth))];
+}
+
+// Appends the neighborhood at depth d of node to hg without building intermediate Hypergraphs.
+void TreeView::append_neighborhood_at_depth(int node, int d, Hypergraph& hg){
+    TreeNode& t = tree->nodes[node];
+    
+    // Just to make sure that we do not go beyond the Tree.
+    if (d > t.depth)
+        d = t.depth;
+    
+    if (d == 0)
+        hg.append(tree->edge_of(node));
+    else
+        for (int c = t.first_child; c < t.first_child + t.num_of_children; c++)
+            this->append_neighborhood_at_depth(c, d-1, hg);
+}
+
+// We suppose the head node in the Tree is just a "vertex" like {1}
+Hypergraph TreeView::neighborhood_at_depth(int d){
+    Hypergraph hg;
+    
+    hot_counters().neighborhood_calls++;
+    
+    if (d < 0){
+        cout << "Error: Tree depth cannot be negative!" << endl;
+        return hg;
+    }
+    
+    hg.reserve(this->level_size(d));
+    this->append_neighborhood_at_depth(k, d, hg);
+    
+    return hg;
+}
+
+// We suppose the head node in the Tree is just a "vertex" like {1}
+Hypergraph TreeView::neighborhood_down_to_depth(int d){
+    Hypergraph hg;
+    int s = 0;
+    
+    hot_counters().neighborhood_calls++;
+    
+    // Just to make sure that we do not go beyond the Tree.
+    if (d > this->depth())
+        d = this->depth();
+    
+    for (int i = 1; i <= d; i++)
+        s += this->level_size(i);
+    hg.reserve(s);
+    
+    for (int i = 1; i <= d; i++)
+        this->append_neighborhood_at_depth(k, i, hg);
+    
+    return hg;
+}
+
+void TreeView::print(string mode){
+    
+    int s = this->size_of_leaves();
+    
+    if (mode == ""){
+        cout << "Node: ";
+        this->get_node().print();
+        
+        for (int i = 0; i < s; i++){
+            for (int j = 0; j < s; j++)
+                cout << "---";
+            this->get_leave(i).print();
+        }
+    }
+    if (mode == "Mathematica"){
+        cout << "Tree[";
+        this->get_node().print(false);
+        if (s == 0)
+            cout << ", {}]";
+        else{
+            cout << ", {";
+            for (int i = 0; i < s; i++){
+                if (i > 0)
+                    cout << ", ";
+                this->get_leave(i).print("Mathematica");
+            }
+            cout << "}]";
+        }
+        
+    }
+    
+    
+}
+
+#endif
@@ -17,71 +17,399 @@
  Email: f.semih.dundar@yandex.com
 */
 
+#ifndef VARIETY_H
+#define VARIETY_H
+
+#include <cmath>
+#include <memory>
+#include <mutex>
 #include "Structures.h"
 
-// whole_tree is the tree of everypossible neighborhood in the Hypergraph.
-// This is a type memoization.
-// u and v are two vertices such that u != v
+// tu and tv are the neighborhood trees of two vertices u and v such that u != v,
+// usually taken from the whole tree of the Hypergraph (see below).
 // If zero is returned the Hypergraphs is non-Leibnizian
-int relative_indifference(Tree &whole_tree, int u, int v){
-    Tree tu = whole_tree.neighborhood_of_vertex(u);
-    Tree tv = whole_tree.neighborhood_of_vertex(v);
-    
+// If cancelled is given and becomes true on the way, -1 is returned.
+int relative_indifference(TreeView tu, TreeView tv, const atomic<bool>* cancelled = nullptr){
     int ud = tu.depth();
     int vd = tv.depth();
     int d = min(ud, vd);
     
     Hypergraph hg1, hg2;
-
-    // Let us create the threads for OpenMP here. 7 Jan 23, 20:00
-    // NUM_THREADS is defined in Structures.h
-    //omp_set_num_threads(NUM_THREADS);
-
+    Rule mapping;
+    
     // Since all vertices are created equal, we begin with depth = 1
+    // The neighborhoods grow by one level at each step. Up to depth i-1 they are isomorphic,
+    // so a level that differs in size already settles depth i. The invariant hashes are kept
+    // in the Trees, so the neighborhoods are only built for pairs that they do not tell apart;
+    // those are counted as calls of is_isomorph_to rejected by the hash. Otherwise the mapping
+    // found at depth i-1 is tried first for depth i.
     for (int i = 1; i <= d; i++){
-        hg1 = tu.neighborhood_down_to_depth(i);
-        hg2 = tv.neighborhood_down_to_depth(i);
-        if (!hg1.is_isomorph_to(hg2))
+        if ((cancelled != nullptr) && cancelled->load(memory_order_relaxed))
+            return -1;
+        
+        if (tu.level_size(i) != tv.level_size(i))
+            return i;
+        
+        const unsigned long long h1 = tu.invariant_hash(i);
+        const unsigned long long h2 = tv.invariant_hash(i);
+        if (h1 != h2){
+            hot_counters().iso_calls++;
+            hot_counters().iso_rejected_by_hash++;
+            return i;
+        }
+        
+        hg1.union_with(tu.neighborhood_at_depth(i));
+        hg2.union_with(tv.neighborhood_at_depth(i));
+        hg1.set_invariant_hash(h1);
+        hg2.set_invariant_hash(h2);
+        if (!hg1.is_isomorph_to(hg2, mapping))
             return i;
     }
     
     return 0;
 }
 
+// whole_tree is the tree of everypossible neighborhood in the Hypergraph.
+// This is a type memoization.
+int relative_indifference(Tree &whole_tree, int u, int v, const atomic<bool>* cancelled = nullptr){
+    return relative_indifference(whole_tree.neighborhood_of_vertex(u), whole_tree.neighborhood_of_vertex(v), cancelled);
+}
+
 // vs is a list of vertices of the Hypergraph
 // whole_tree is a pointer
-int absolute_indifference(Tree &whole_tree, vector<int> unique_vertices, int u){
+int absolute_indifference(Tree &whole_tree, const vector<int>& unique_vertices, int u){
     int ri = 0;
     int ri_pre = 0;
-        
+    
     for (int v : unique_vertices)
       if (v != u){
 	ri_pre = relative_indifference(whole_tree, u, v);
 	if (ri_pre == 0) // Meaning that the Hypergraph is non-Leibnizian
 	  return 0;
-	
+
 	ri = max(ri, ri_pre);
       }
     
     return ri;
 }
 
-// Convert this function to return a rational number
-double variety(Hypergraph hg){
-    Tree whole_tree(hg);
+// The relative indifference is symmetric, so it is kept for each unordered pair {i, j} of
+// indices of unique vertices (i < j) only once, in a packed upper triangular array.
+long long pair_index(int i, int j, int n){
+    return (long long) i * (2*n - i - 1) / 2 + (j - i - 1);
+}
+
+// Inverse of pair_index: finds the pair (i, j) with pair_index(i, j, n) = k.
+void pair_of_index(long long k, int n, int& i, int& j){
+    // Row i starts at pair_index(i, i+1, n). We estimate i from the quadratic formula and fix
+    // the rounding errors.
+    double b = 2.0*n - 1;
+    i = (int) ((b - sqrt(b*b - 8.0*k)) / 2);
+    if (i < 0)
+        i = 0;
+    while ((i > 0) && (pair_index(i, i+1, n) > k))
+        i--;
+    while ((i < n-2) && (pair_index(i+1, i+2, n) <= k))
+        i++;
+    j = (int) (k - pair_index(i, i+1, n)) + i + 1;
+}
+
+// Counts of the work done for one Hypergraph.
+struct VarietyStats{
+    long long pairs_total = 0;
+    long long pairs_computed = 0;
+    bool leibnizian = true;
+    
+    // Hypergraphs found non-Leibnizian by an automorphism, before any pair was computed.
+    long long by_automorphism = 0;
+    
+    void add(const VarietyStats& st){
+        pairs_total += st.pairs_total;
+        pairs_computed += st.pairs_computed;
+        by_automorphism += st.by_automorphism;
+    };
+};
+
+// All parallel work (vertex pairs, and the mapping searches inside is_isomorph_to) is made of
+// OpenMP tasks, so that one team of threads steals work from wherever it is left. run_tasks
+// opens that team unless the caller is already running inside it, as in batch mode.
+template <class Job>
+void run_tasks(Job job){
+    if (omp_in_parallel())
+        job();
+    else{
+        #pragma omp parallel
+        #pragma omp single
+        job();
+    }
+}
+
+// Relative indifferences of all pairs of unique_vertices, indexed by pair_index.
+// Each unordered pair is computed once, in its own task since their costs vary a lot,
+// and written to its own slot.
+// As soon as some pair has zero relative indifference the Hypergraph is known to be
+// non-Leibnizian: the other threads are told to stop, false is returned and the pairs that
+// were not computed are left as -1.
+bool relative_indifference_matrix(Tree &whole_tree, const vector<int>& unique_vertices, vector<int>& ri, VarietyStats& stats){
+    const int n = unique_vertices.size();
+    const long long num_of_pairs = (long long) n * (n-1) / 2;
+    atomic<bool> cancelled(false);
+    atomic<long long> computed(0);
+    CounterSet* counters = current_counter_set;
+    
+    ri.assign(num_of_pairs, -1);
+    
+    run_tasks([&](){
+        #pragma omp taskloop grainsize(1) default(shared)
+        for (long long k = 0; k < num_of_pairs; k++){
+            if (cancelled.load(memory_order_relaxed))
+                continue;
+            
+            CounterScope scope(counters);
+            int i, j;
+            pair_of_index(k, n, i, j);
+            int r = relative_indifference(whole_tree, unique_vertices[i], unique_vertices[j], &cancelled);
+            
+            if (r >= 0){
+                ri[k] = r;
+                computed.fetch_add(1, memory_order_relaxed);
+            }
+            if (r == 0)
+                cancelled.store(true, memory_order_relaxed);
+        }
+    });
+    
+    stats.pairs_total += num_of_pairs;
+    stats.pairs_computed += computed.load();
+    
+    return !cancelled.load();
+}
+
+// Absolute indifference of each vertex, in the same order as relative_indifference_matrix.
+// Same as absolute_indifference: zero if some ri is zero, the maximum ri otherwise.
+vector<int> absolute_indifferences_from_matrix(const vector<int>& ri, int n){
+    vector<int> ai(n, 0);
+    vector<bool> has_zero(n, false);
+    
+    for (int i = 0; i < n; i++)
+        for (int j = i+1; j < n; j++){
+            int r = ri[pair_index(i, j, n)];
+            if (r == 0){
+                has_zero[i] = true;
+                has_zero[j] = true;
+            }
+            ai[i] = max(ai[i], r);
+            ai[j] = max(ai[j], r);
+        }
+    
+    for (int i = 0; i < n; i++)
+        if (has_zero[i])
+            ai[i] = 0;
+    
+    return ai;
+}
+
+// Absolute indifferences of all vertices of the Hypergraph, in the order of unique_vertices.
+// If the Hypergraph is non-Leibnizian the computation stops early and {0} is returned, since
+// then the variety is zero whatever the other values are.
+vector<int> absolute_indifferences(const Hypergraph& hg, VarietyStats& stats){
+    // The vertices are relabeled 0, ..., n-1 in their order, so that the Rules and the tables of
+    // vertices below are arrays; the ai values come in the same order. hg keeps its labels.
+    vector<int> labels;
+    Hypergraph dense = hg.densely_relabeled(labels);
+    
+    // If some automorphism maps u to v, it maps each neighborhood of u onto the one of v of the
+    // same depth, so their relative indifference is zero. One such automorphism settles the
+    // Hypergraph without building the tree.
+    Rule automorphism;
+    if (dense.find_moving_automorphism(automorphism, AUTOMORPHISM_SEARCH_BUDGET)){
+        const long long n = labels.size();
+        stats.pairs_total += n * (n-1) / 2;
+        stats.leibnizian = false;
+        stats.by_automorphism++;
+        return vector<int>(1, 0);
+    }
+    
+    Tree whole_tree(dense.flat_index());
+    
+    vector<int> unique_elements(labels.size());
+    for (int x = 0; x < (int) labels.size(); x++)
+        unique_elements[x] = x;
+    vector<int> ri;
+    
+    if (!relative_indifference_matrix(whole_tree, unique_elements, ri, stats)){
+        stats.leibnizian = false;
+        return vector<int>(1, 0);
+    }
+    
+    vector<int> ai = absolute_indifferences_from_matrix(ri, unique_elements.size());
+    
+    // A single vertex has zero absolute indifference.
+    for (int a : ai)
+        if (a == 0)
+            stats.leibnizian = false;
+    
+    return ai;
+}
+
+vector<int> absolute_indifferences(const Hypergraph& hg){
+    VarietyStats stats;
+    
+    return absolute_indifferences(hg, stats);
+}
+
+// LEIBNIZIAN VERDICT
+// When only the verdict is needed, and not the ai list, the search can stop at the first pair
+// of zero relative indifference and skip every pair that cannot have one. A pair whose
+// neighborhoods differ in size at some depth up to the smaller depth has nonzero relative
+// indifference (see relative_indifference); at depth 1 the size is the degree, so such pairs are
+// dropped before any neighborhood is built. Of the other pairs, the ones whose vertices have the
+// same degree signature, the arities and positions of their occurrences, are tried first since
+// they are the likeliest to match. Instead of the whole tree, each vertex gets its own
+// neighborhood tree the first time one of its pairs is tried, so a Hypergraph that is settled
+// early does not pay for the trees of all its vertices.
+
+// Whether the neighborhoods tu and tv have the same number of Hyperedges at each depth up to the
+// smaller depth of the two.
+bool same_level_sizes(TreeView tu, TreeView tv){
+    int d = min(tu.depth(), tv.depth());
     
+    for (int i = 1; i <= d; i++)
+        if (tu.level_size(i) != tv.level_size(i))
+            return false;
+    
+    return true;
+}
+
+// For each vertex 0, ..., n-1 of hg, the arities and positions of its occurrences, sorted, and
+// its degree: the number of Hyperedges at depth 1 of its neighborhood, i.e. the Hyperedges that
+// contain it, except the ones equal to {u} (see Tree::grow).
+void degree_signatures(const Hypergraph& hg, int n, vector<vector<int> >& sig, vector<int>& degree){
+    sig.assign(n, vector<int>());
+    degree.assign(n, 0);
+    
+    for (int i = 0; i < hg.size(); i++){
+        const VertexList& vs = hg.get(i).get_vertices();
+        for (int p = 0; p < (int) vs.size(); p++){
+            sig[vs[p]].push_back((int) vs.size() * 65536 + p);
+            if ((vs.size() > 1) && (find(vs.begin(), vs.begin() + p, vs[p]) == vs.begin() + p))
+                degree[vs[p]]++;
+        }
+    }
+    for (auto& s : sig)
+        sort(s.begin(), s.end());
+}
+
+// Whether the Hypergraph is Leibnizian, i.e. whether the ai list of absolute_indifferences has
+// no zero, computed without the ai list. stats.pairs_computed counts the pairs whose relative
+// indifference was searched for.
+bool is_leibnizian(const Hypergraph& hg, VarietyStats& stats){
+    vector<int> labels;
+    Hypergraph dense = hg.densely_relabeled(labels);
+    const int n = labels.size();
+    
+    stats.pairs_total += (long long) n * (n-1) / 2;
+    stats.leibnizian = false;
+    
+    // A single vertex has zero absolute indifference.
+    if (n == 1)
+        return false;
+    
+    Rule automorphism;
+    if (dense.find_moving_automorphism(automorphism, AUTOMORPHISM_SEARCH_BUDGET)){
+        stats.by_automorphism++;
+        return false;
+    }
+    
+    vector<vector<int> > sig;
+    vector<int> degree;
+    degree_signatures(dense, n, sig, degree);
+    
+    // A vertex of degree 0 has an empty neighborhood, and zero relative indifference with any
+    // other vertex.
+    for (int x = 0; x < n; x++)
+        if (degree[x] == 0)
+            return false;
+    
+    // The pairs left to search, those of equal degree signatures first.
+    vector<pair<int, int> > pairs, others;
+    for (int i = 0; i < n; i++)
+        for (int j = i+1; j < n; j++)
+            if (degree[i] == degree[j])
+                ((sig[i] == sig[j]) ? pairs : others).push_back(make_pair(i, j));
+    pairs.insert(pairs.end(), others.begin(), others.end());
+    
+    // The Trees of the vertices share one FlatHypergraph, so their index of the Hypergraph is
+    // built once, not once for each vertex.
+    const long long num_of_candidates = pairs.size();
+    shared_ptr<const FlatHypergraph> flat = dense.flat_index();
+    vector<unique_ptr<Tree> > trees(n);
+    vector<once_flag> built(n);
+    atomic<bool> cancelled(false);
+    atomic<long long> computed(0);
+    CounterSet* counters = current_counter_set;
+    
+    auto tree_of = [&](int x){
+        call_once(built[x], [&](){
+            Hyperedge he;
+            he.append(x);
+            trees[x].reset(new Tree(flat, he));
+        });
+        return trees[x]->root();
+    };
+    
+    // As in relative_indifference_matrix, the pairs are tasks and the first zero stops them all.
+    // The tasks are created in order, so the likely pairs are taken first.
+    run_tasks([&](){
+        #pragma omp taskloop grainsize(1) default(shared)
+        for (long long k = 0; k < num_of_candidates; k++){
+            if (cancelled.load(memory_order_relaxed))
+                continue;
+            
+            CounterScope scope(counters);
+            TreeView tu = tree_of(pairs[k].first);
+            TreeView tv = tree_of(pairs[k].second);
+            if (!same_level_sizes(tu, tv))
+                continue;
+            
+            int r = relative_indifference(tu, tv, &cancelled);
+            if (r >= 0)
+                computed.fetch_add(1, memory_order_relaxed);
+            if (r == 0)
+                cancelled.store(true, memory_order_relaxed);
+        }
+    });
+    
+    stats.pairs_computed += computed.load();
+    stats.leibnizian = !cancelled.load();
+    
+    return stats.leibnizian;
+}
+
+bool is_leibnizian(const Hypergraph& hg){
+    VarietyStats stats;
+    
+    return is_leibnizian(hg, stats);
+}
+
+// Convert this function to return a rational number
+double variety(const Hypergraph& hg){
     vector<int> unique_elements = hg.unique_vertices().get_vertices();
+    VarietyStats stats;
+    vector<int> ais = absolute_indifferences(hg, stats);
     int s = unique_elements.size();
     
     double var = 0;
     double ai;
     
-    for (int i : unique_elements){
-        ai = absolute_indifference(whole_tree, unique_elements, i);
-	cout << "vertex: " << i << ", ai: " << ai << endl;
-        if (ai == 0){ // Meaning that the Hypergraph is non-Leibnizian
-	  return 0;
-	}
+    if (!stats.leibnizian){ // Meaning that the Hypergraph is non-Leibnizian
+        cout << "non-Leibnizian" << endl;
+        return 0;
+    }
+    
+    for (int i = 0; i < s; i++){
+        ai = ais[i];
+	cout << "vertex: " << unique_elements[i] << ", ai: " << ai << endl;
         
         var += 1/ai;
     }
@@ -90,44 +418,39 @@ double variety(Hypergraph hg){
 }
 
 int variety_omp_print(string str){
-
-    Hypergraph hg(str);    
-    Tree whole_tree(hg);
     
-    vector<int> unique_elements = hg.unique_vertices().get_vertices();
-    int s = unique_elements.size();
-
-    vector<int> ai;
-    int ai_tmp;
+    Hypergraph hg(str);
+    
+    vec_print(absolute_indifferences(hg));
+  
   
-    #pragma omp parallel for
-    for (int i = 0; i < s; i++){
-      ai_tmp = absolute_indifference(whole_tree, unique_elements, unique_elements[i]);
-      ai.push_back(ai_tmp);
-    }
-
-    vec_print(ai);
-
-
   return 0;
 }
 
-string variety_omp_str(string str){
-
+string variety_omp_str(string str, VarietyStats& stats){
+    
     Hypergraph hg(str);
-    Tree whole_tree(hg);
     
-    vector<int> unique_elements = hg.unique_vertices().get_vertices();
-    int s = unique_elements.size();
+    return vec_str(absolute_indifferences(hg, stats));
+}
 
-    vector<int> ai;
-    int ai_tmp;
-  
-    #pragma omp parallel for
-    for (int i = 0; i < s; i++){
-      ai_tmp = absolute_indifference(whole_tree, unique_elements, unique_elements[i]);
-      ai.push_back(ai_tmp);
-    }
+string variety_omp_str(string str){
+    VarietyStats stats;
+    
+    return variety_omp_str(str, stats);
+}
 
-    return vec_str(ai);
+string variety_stats_str(const VarietyStats& stats, int num_of_hypergraphs, int num_of_non_leibnizian){
+    string str = "";
+    
+    str += "hypergraphs: " + to_string(num_of_hypergraphs);
+    str += ", non-Leibnizian: " + to_string(num_of_non_leibnizian);
+    str += ", vertex pairs: " + to_string(stats.pairs_total);
+    str += ", computed: " + to_string(stats.pairs_computed);
+    str += ", skipped: " + to_string(stats.pairs_total - stats.pairs_computed);
+    str += ", found by automorphism: " + to_string(stats.by_automorphism);
+    
+    return str;
 }
+
+#endif
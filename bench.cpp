@@ -0,0 +1,508 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#include "omp.h"
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include "Variety.h"
+#include "Allocations.h"
+#include "Input.h"
+#include "Multiway.h"
+
+using namespace std;
+
+// Seconds elapsed since t0.
+double seconds_since(chrono::steady_clock::time_point t0){
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// Prints one result as a JSON line.
+void report(string benchmark, string method, double bytes, double seconds){
+    cout << "{\"benchmark\":\"" << benchmark << "\",\"method\":\"" << method << "\""
+         << ",\"bytes\":" << (long long) bytes << ",\"seconds\":" << seconds
+         << ",\"mb_per_s\":" << bytes / seconds / 1e6 << "}" << endl;
+}
+
+// Prints one timing as a JSON line. seconds is the time of one run of the benchmark.
+void report_time(string benchmark, string family, int size, int threads, double seconds){
+    cout << "{\"benchmark\":\"" << benchmark << "\",\"family\":\"" << family << "\""
+         << ",\"size\":" << size << ",\"threads\":" << threads
+         << ",\"seconds\":" << seconds << "}" << endl;
+}
+
+// Prints the number of heap allocations of one run of a benchmark as a JSON line.
+void report_allocations(string benchmark, string family, int size, double allocations){
+    cout << "{\"benchmark\":\"" << benchmark << "\",\"family\":\"" << family << "\""
+         << ",\"size\":" << size << ",\"allocations\":" << allocations << "}" << endl;
+}
+
+// Seconds of one run of job, averaged over as many runs as fit in min_seconds (at least one).
+template <class Job>
+double time_per_run(Job job, double min_seconds = 0.2){
+    auto t0 = chrono::steady_clock::now();
+    long long runs = 0;
+    
+    do{
+        job();
+        runs++;
+    } while (seconds_since(t0) < min_seconds);
+    
+    return seconds_since(t0) / runs;
+}
+
+// Heap allocations of one run of job, averaged over runs runs.
+template <class Job>
+double allocations_per_run(int runs, Job job){
+    long long allocations = hot_counters().allocations;
+    
+    for (int i = 0; i < runs; i++)
+        job();
+    
+    return (double) (hot_counters().allocations - allocations) / runs;
+}
+
+// Linear congruential generator: the families are the same on every machine and every run.
+class BenchRandom{
+
+private:
+    unsigned long long x;
+
+public:
+    BenchRandom(unsigned long long seed){
+        x = seed;
+    };
+    
+    // A number in [0, m).
+    int next(int m){
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (int) ((x >> 33) % m);
+    };
+};
+
+// GENERATED FAMILIES
+// Each family gives a Hypergraph of the requested size (roughly its number of vertices).
+
+// m random Hyperedges of arity k on the vertices 1, ..., n.
+Hypergraph random_uniform_hypergraph(int n, int m, int k, BenchRandom& rnd){
+    Hypergraph hg;
+    
+    for (int i = 0; i < m; i++){
+        Hyperedge he;
+        for (int j = 0; j < k; j++)
+            he.append(1 + rnd.next(n));
+        hg.append(he);
+    }
+    
+    return hg;
+}
+
+// Lattice of h rows and w columns, with edges to the right and downwards.
+Hypergraph lattice_hypergraph(int h, int w){
+    Hypergraph hg;
+    
+    for (int i = 0; i < h; i++)
+        for (int j = 0; j < w; j++){
+            int u = 1 + i*w + j;
+            if (j+1 < w)
+                hg.append(Hyperedge(vector<int>{u, u+1}));
+            if (i+1 < h)
+                hg.append(Hyperedge(vector<int>{u, u+w}));
+        }
+    
+    return hg;
+}
+
+// Directed cycle on n vertices: every rotation is an automorphism, so every vertex mapping
+// candidate looks alike until the last vertex. (Denser symmetric graphs, such as complete graphs,
+// make the Tree itself explode.)
+Hypergraph cycle_hypergraph(int n){
+    Hypergraph hg;
+    
+    for (int u = 1; u <= n; u++)
+        hg.append(Hyperedge(vector<int>{u, 1 + u % n}));
+    
+    return hg;
+}
+
+// A state of a Wolfram model evolution: the rule {{1,2},{1,3}}->{{1,2},{1,4},{2,4},{3,4}} is
+// applied at its first match, steps times, starting from {{1,1},{1,1}}.
+Hypergraph wolfram_model_hypergraph(int steps){
+    vector<WolframRule> rules;
+    string error;
+    parse_rules("{{1,2},{1,3}}->{{1,2},{1,4},{2,4},{3,4}}", rules, error);
+    
+    CanonicalForm state;
+    state.num_of_vertices = 1;
+    state.edges = {{0, 0}, {0, 0}};
+    for (int i = 0; i < steps; i++)
+        state = successors_of_state(state.edges, state.num_of_vertices, rules)[0];
+    
+    MultiwayState s;
+    s.form = state;
+    return s.hypergraph();
+}
+
+// A random Hypergraph with two twin vertices attached to the same vertex in the same way, so
+// that their relative indifference is zero.
+Hypergraph non_leibnizian_hypergraph(int n, BenchRandom& rnd){
+    Hypergraph hg = random_uniform_hypergraph(n, n, 2, rnd);
+    
+    hg.append(Hyperedge(vector<int>{n+1, 1}));
+    hg.append(Hyperedge(vector<int>{n+2, 1}));
+    
+    return hg;
+}
+
+// The same Hypergraph with its vertices relabeled at random; r is the relabeling.
+Hypergraph relabeled_hypergraph(const Hypergraph& hg, BenchRandom& rnd, Rule& r){
+    vector<int> uv = hg.unique_vertices().get_vertices();
+    vector<int> labels = uv;
+    
+    for (int i = (int) labels.size() - 1; i > 0; i--)
+        swap(labels[i], labels[rnd.next(i+1)]);
+    for (int i = 0; i < (int) uv.size(); i++)
+        r[uv[i]] = labels[i];
+    
+    return hg.map_via_rule(r);
+}
+
+Hypergraph relabeled_hypergraph(const Hypergraph& hg, BenchRandom& rnd){
+    Rule r;
+    
+    return relabeled_hypergraph(hg, rnd, r);
+}
+
+// Hypergraph of the family with the given size.
+Hypergraph generate_hypergraph(string family, int size){
+    BenchRandom rnd(size);
+    
+    if (family == "uniform")
+        return random_uniform_hypergraph(size, size, 3, rnd);
+    if (family == "lattice")
+        return lattice_hypergraph(2, size / 2);
+    if (family == "cycle")
+        return cycle_hypergraph(size);
+    if (family == "wolfram")
+        return wolfram_model_hypergraph(size / 3);
+    return non_leibnizian_hypergraph(size, rnd);
+}
+
+// Times the stages of the computation on one Hypergraph: parsing its text, building its Tree, the
+// relative indifference of each vertex pair (on one thread), an isomorphism test against a
+// relabeled copy, the check of the mapping found by it, and absolute_indifferences at each thread
+// count. The heap allocations of the Tree, the isomorphism test and the check are counted too.
+void bench_family(string family, int size, vector<int>& thread_counts){
+    Hypergraph hg = generate_hypergraph(family, size);
+    BenchRandom rnd(size + 1);
+    Hypergraph copy = relabeled_hypergraph(hg, rnd);
+    string text = hg.str();
+    vector<int> uv = hg.unique_vertices().get_vertices();
+    long long checksum = 0;
+    
+    omp_set_num_threads(1);
+    
+    report_time("parse", family, size, 1, time_per_run([&](){
+        checksum += Hypergraph(text).size();
+    }));
+    
+    report_time("tree", family, size, 1, time_per_run([&](){
+        checksum += Tree(hg).depth();
+    }));
+    report_allocations("tree", family, size, allocations_per_run(10, [&](){
+        checksum += Tree(hg).depth();
+    }));
+    
+    Tree whole_tree(hg);
+    const int n = uv.size();
+    const long long num_of_pairs = (long long) n * (n-1) / 2;
+    if (num_of_pairs > 0)
+        report_time("pair_ri", family, size, 1, time_per_run([&](){
+            for (int i = 0; i < n; i++)
+                for (int j = i+1; j < n; j++)
+                    checksum += relative_indifference(whole_tree, uv[i], uv[j]);
+        }) / num_of_pairs);
+    
+    report_time("isomorphism", family, size, 1, time_per_run([&](){
+        checksum += hg.is_isomorph_to(copy);
+    }));
+    report_allocations("isomorphism", family, size, allocations_per_run(100, [&](){
+        checksum += hg.is_isomorph_to(copy);
+    }));
+    
+    Rule mapping;
+    if (hg.is_isomorph_to(copy, mapping)){
+        report_time("via_rule", family, size, 1, time_per_run([&](){
+            checksum += hg.is_isomorph_to_via_rule(true, mapping, copy);
+        }));
+        report_allocations("via_rule", family, size, allocations_per_run(1000, [&](){
+            checksum += hg.is_isomorph_to_via_rule(true, mapping, copy);
+        }));
+    }
+    
+    for (int t : thread_counts){
+        omp_set_num_threads(t);
+        report_time("end_to_end", family, size, t, time_per_run([&](){
+            checksum += absolute_indifferences(hg).size();
+        }, 0));
+        report_time("leibnizian", family, size, t, time_per_run([&](){
+            checksum += is_leibnizian(hg);
+        }, 0));
+    }
+    
+    // So that the loops are not optimized away.
+    if (checksum == 42)
+        cout << endl;
+}
+
+// The check of a rule as it was done before EdgeMultiset: each image is looked for among the
+// Hyperedges of hg2 that are not matched yet, one by one.
+bool is_isomorph_to_via_rule_by_scan(const Hypergraph& hg, const Rule& r, const Hypergraph& hg2){
+    vector<char> matched(hg2.size(), 0);
+    
+    for (int i = 0; i < hg.size(); i++){
+        Hyperedge image = hg.get(i).map_via_rule(r);
+        int j = 0;
+        while ((j < hg2.size()) && (matched[j] || (hg2.get(j) != image)))
+            j++;
+        if (j == hg2.size())
+            return false;
+        matched[j] = 1;
+    }
+    
+    return true;
+}
+
+// Checks of a rule on random 3-uniform Hypergraphs of the size of large neighborhoods (50 to 200
+// Hyperedges) against a relabeled copy: by scanning, with the EdgeMultiset of the copy built at
+// each check, and with it built once. The allocations per check are reported for the latter.
+void bench_edge_matching(){
+    long long checksum = 0;
+    
+    omp_set_num_threads(1);
+    
+    for (int e : {50, 100, 200}){
+        BenchRandom rnd(e);
+        Hypergraph hg = random_uniform_hypergraph(e / 2, e, 3, rnd);
+        Rule r;
+        Hypergraph copy = relabeled_hypergraph(hg, rnd, r);
+        EdgeMultiset edges2;
+        
+        copy.edge_multiset(edges2);
+        
+        report_time("via_rule_scan", "neighborhood", e, 1, time_per_run([&](){
+            checksum += is_isomorph_to_via_rule_by_scan(hg, r, copy);
+        }));
+        report_time("via_rule", "neighborhood", e, 1, time_per_run([&](){
+            checksum += hg.is_isomorph_to_via_rule(true, r, copy);
+        }));
+        report_time("via_rule_multiset", "neighborhood", e, 1, time_per_run([&](){
+            checksum += hg.is_isomorph_to_via_rule(r, edges2);
+        }));
+        report_allocations("via_rule_multiset", "neighborhood", e, allocations_per_run(1000, [&](){
+            checksum += hg.is_isomorph_to_via_rule(r, edges2);
+        }));
+    }
+    
+    // So that the loops are not optimized away.
+    if (checksum == 42)
+        cout << endl;
+}
+
+// The neighborhood of a Hyperedge as it was found before the incidence masks: the incidence
+// lists of its vertices are merged, sorted and deduplicated.
+vector<int> neighborhood_by_lists(FlatHypergraph& fh, const Hyperedge& he){
+    vector<int> ids;
+    
+    for (int u : he.get_vertices()){
+        vector<int> n = fh.neighborhood_of_vertex(u);
+        ids.insert(ids.end(), n.begin(), n.end());
+    }
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+    
+    return ids;
+}
+
+// Neighborhood queries on random 3-uniform Hypergraphs with up to thousands of vertices, with
+// twice as many Hyperedges (sparse) or sixteen times as many (dense): the neighborhood of each
+// Hyperedge by merging incidence lists and by FlatHypergraph (which takes the union of incidence
+// masks where it pays off), and the unique vertices of the whole Hypergraph.
+void bench_neighborhoods(){
+    long long checksum = 0;
+    vector<pair<string, int> > cases = {{"sparse", 500}, {"sparse", 1000}, {"sparse", 2000}, {"sparse", 4000},
+                                        {"dense", 125}, {"dense", 250}, {"dense", 500}};
+    
+    omp_set_num_threads(1);
+    
+    for (auto& c : cases){
+        const string family = c.first;
+        const int n = c.second;
+        BenchRandom rnd(n);
+        Hypergraph hg = random_uniform_hypergraph(n, ((family == "dense") ? 16 : 2) * n, 3, rnd);
+        FlatHypergraph fh(hg);
+        vector<int> ids;
+        
+        report_time("neighborhood_lists", family, n, 1, time_per_run([&](){
+            for (int i = 0; i < hg.size(); i++)
+                checksum += neighborhood_by_lists(fh, hg.get(i)).size();
+        }) / hg.size());
+        report_time("neighborhood", family, n, 1, time_per_run([&](){
+            for (int i = 0; i < hg.size(); i++){
+                fh.neighborhood_of_hyperedge(hg.get(i), ids);
+                checksum += ids.size();
+            }
+        }) / hg.size());
+        report_time("unique_vertices", family, n, 1, time_per_run([&](){
+            checksum += hg.unique_vertices().size();
+        }));
+    }
+    
+    // So that the loops are not optimized away.
+    if (checksum == 42)
+        cout << endl;
+}
+
+// Writes num_of_lines random hypergraphs, with 10 to 40 Hyperedges of arity 2 or 3 each,
+// to file_name. The generator is seeded, so the file is always the same.
+void write_parse_input(string file_name, int num_of_lines){
+    ofstream file(file_name);
+    BenchRandom rnd(12345);
+    auto next = [&](int m){
+        return rnd.next(m);
+    };
+    
+    for (int k = 0; k < num_of_lines; k++){
+        Hypergraph hg;
+        int e = 10 + next(31);
+        for (int i = 0; i < e; i++){
+            Hyperedge he;
+            int a = 2 + next(2);
+            for (int j = 0; j < a; j++)
+                he.append(1 + next(100000));
+            hg.append(he);
+        }
+        file << hg.str() << "\n";
+    }
+}
+
+// Parse throughput of the input file in MB/s, for the memory-mapped parser alone, the parser
+// building Hypergraphs, and reading with getline and Hypergraph(string).
+void bench_parse(string file_name){
+    MappedFile file;
+    
+    if (!file.open(file_name)){
+        cout << "Error: cannot open " << file_name << endl;
+        return;
+    }
+    
+    double bytes = file.size();
+    long long checksum = 0;
+    
+    {
+        vector<int> vertices, offsets;
+        const char* error_pos;
+        const char* error_msg;
+        InputLine line;
+        LineReader lines(file.begin(), file.end());
+        auto t0 = chrono::steady_clock::now();
+        
+        while (lines.next(line)){
+            vertices.clear();
+            offsets.assign(1, 0);
+            parse_hypergraph(line.begin, line.end, vertices, offsets, error_pos, error_msg);
+            checksum += vertices.size();
+        }
+        report("parse", "mmap_flat", bytes, seconds_since(t0));
+    }
+    
+    {
+        Hypergraph hg;
+        string error;
+        InputLine line;
+        LineReader lines(file.begin(), file.end());
+        auto t0 = chrono::steady_clock::now();
+        
+        while (lines.next(line)){
+            parse_line(line, file_name, hg, error);
+            checksum += hg.size();
+        }
+        report("parse", "mmap_hypergraph", bytes, seconds_since(t0));
+    }
+    
+    {
+        ifstream in(file_name);
+        string line;
+        auto t0 = chrono::steady_clock::now();
+        
+        while (getline(in, line))
+            checksum += Hypergraph(line).size();
+        report("parse", "getline_string", bytes, seconds_since(t0));
+    }
+    
+    // So that the loops are not optimized away.
+    if (checksum == 42)
+        cout << endl;
+}
+
+int main(int argc, char ** argv){
+    
+    map<string, vector<int> > sizes;
+    sizes["uniform"] = {6, 8, 10};
+    sizes["lattice"] = {6, 8, 10};
+    sizes["cycle"] = {8, 16, 32};
+    sizes["wolfram"] = {6, 9, 15};
+    sizes["non_leibnizian"] = {8, 10, 12};
+    
+    // One thread, and powers of two up to all cores.
+    vector<int> thread_counts;
+    for (int t = 1; t < omp_get_max_threads(); t *= 2)
+        thread_counts.push_back(t);
+    thread_counts.push_back(omp_get_max_threads());
+    
+    // A family name runs that family only, edge_matching or neighborhoods that part only; a file
+    // name measures its parse throughput only.
+    if (argc >= 2){
+        string arg = argv[1];
+        
+        if (arg == "edge_matching")
+            bench_edge_matching();
+        else if (arg == "neighborhoods")
+            bench_neighborhoods();
+        else if (sizes.count(arg) > 0)
+            for (int size : sizes[arg])
+                bench_family(arg, size, thread_counts);
+        else
+            bench_parse(arg);
+        return 0;
+    }
+    
+    string file_name = "bench_parse_input.txt";
+    write_parse_input(file_name, 200000);
+    bench_parse(file_name);
+    remove(file_name.c_str());
+    
+    for (auto& family : sizes)
+        for (int size : family.second)
+            bench_family(family.first, size, thread_counts);
+    bench_edge_matching();
+    bench_neighborhoods();
+    
+    return 0;
+}
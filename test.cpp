@@ -0,0 +1,451 @@
+/*
+ # LICENSE
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+ Copyright 2023, Furkan Semih DÜNDAR
+ Email: f.semih.dundar@yandex.com
+*/
+
+#include "omp.h"
+#include <iostream>
+#include <fstream>
+#include <random>
+#include "Variety.h"
+#include "Allocations.h"
+#include "Corpus.h"
+#include "Cache.h"
+#include "Paths.h"
+
+using namespace std;
+
+// Regression checks of the isomorphism test, the canonical form and the ai lists against known
+// results, so that a change of the search does not change the answers, and of the files that
+// wmvar reads and writes. Run with `make test`; the exit status is the number of failed checks.
+// Temporary files are written in the current directory.
+
+int num_of_failures = 0;
+
+void check(bool ok, string what){
+    if (!ok){
+        cout << "FAILED: " << what << endl;
+        num_of_failures++;
+    }
+}
+
+// hg with its vertices renamed by a random one-to-one map into labels, and its Hyperedges
+// shuffled. r is set to the renaming.
+Hypergraph relabeled(const Hypergraph& hg, const vector<int>& labels, mt19937& rnd, Rule& r){
+    vector<int> uv = hg.unique_vertices().get_vertices();
+    vector<int> image = labels;
+    shuffle(image.begin(), image.end(), rnd);
+    
+    r.clear();
+    for (int x = 0; x < (int) uv.size(); x++)
+        r[uv[x]] = image[x];
+    
+    vector<Hyperedge> edges;
+    for (int i = 0; i < hg.size(); i++)
+        edges.push_back(hg.get(i).map_via_rule(r));
+    shuffle(edges.begin(), edges.end(), rnd);
+    
+    return Hypergraph(edges);
+}
+
+// Isomorphic copies of hg, on small, sparse and negative labels, are found isomorphic, with a
+// mapping that checks out, and have the canonical form of hg.
+void check_copies(string str, mt19937& rnd){
+    Hypergraph hg(str);
+    const int n = hg.unique_vertices().size();
+    CanonicalForm cf = hg.canonical_form();
+    vector<vector<int> > label_sets(4);
+    
+    for (int x = 0; x < n; x++){
+        label_sets[0].push_back(x + 1);
+        label_sets[1].push_back(1000000 * (x + 1) + 7);
+        label_sets[2].push_back(-3 * x - 1);
+        label_sets[3].push_back(2000000000 - 5 * x);
+    }
+    
+    for (auto& labels : label_sets){
+        Rule r, mapping;
+        Hypergraph copy = relabeled(hg, labels, rnd, r);
+        string what = str + " vs " + copy.str();
+        
+        check(hg.is_isomorph_to(copy), "is_isomorph_to " + what);
+        check(hg.is_isomorph_to(copy, mapping) && hg.is_isomorph_to_via_rule(true, mapping, copy),
+              "mapping of " + what);
+        
+        CanonicalForm cf2 = copy.canonical_form();
+        check((cf.found == cf2.found) && (!cf.found || (cf.edges == cf2.edges)), "canonical_form " + what);
+    }
+}
+
+// hg1 and hg2 are isomorphic, with a mapping that checks out.
+void check_isomorphic(string str1, string str2){
+    Hypergraph hg1(str1), hg2(str2);
+    string what = str1 + " vs " + str2;
+    Rule mapping;
+    
+    check(hg1.is_isomorph_to(hg2), "is_isomorph_to " + what);
+    check(hg1.is_isomorph_to(hg2, mapping) && hg1.is_isomorph_to_via_rule(true, mapping, hg2), "mapping of " + what);
+}
+
+// hg1 and hg2 are not isomorphic, and their canonical forms differ.
+void check_not_isomorphic(string str1, string str2){
+    Hypergraph hg1(str1), hg2(str2);
+    string what = str1 + " vs " + str2;
+    
+    check(!hg1.is_isomorph_to(hg2), "not is_isomorph_to " + what);
+    
+    CanonicalForm cf1 = hg1.canonical_form();
+    CanonicalForm cf2 = hg2.canonical_form();
+    check(!cf1.found || !cf2.found || (cf1.edges != cf2.edges), "canonical_form " + what);
+}
+
+// The ai list of hg is ais, and the verdict of is_leibnizian agrees with it.
+void check_ais(string str, vector<int> ais){
+    Hypergraph hg(str);
+    VarietyStats stats;
+    
+    vector<int> result = absolute_indifferences(hg, stats);
+    check(result == ais, "absolute_indifferences " + str + " = " + vec_str(result));
+    
+    bool leibnizian = (find(ais.begin(), ais.end(), 0) == ais.end());
+    check(stats.leibnizian == leibnizian, "leibnizian " + str);
+    check(is_leibnizian(hg) == leibnizian, "is_leibnizian " + str);
+}
+
+// The invariant hashes kept in the Tree are the ones of the neighborhoods they stand for, on the
+// given labels and on sparse ones.
+void check_tree_hashes(string str){
+    Hypergraph hg(str);
+    vector<int> labels;
+    Hypergraph dense = hg.densely_relabeled(labels);
+    
+    for (Hypergraph* h : {&hg, &dense}){
+        Tree whole_tree(*h);
+        
+        vector<int> uv = h->unique_vertices().get_vertices();
+        for (int u : uv){
+            TreeView tu = whole_tree.neighborhood_of_vertex(u);
+            for (int d = 0; d <= tu.depth() + 1; d++)
+                check(tu.invariant_hash(d) == tu.neighborhood_down_to_depth(d).invariant_hash(),
+                      "tree hash of " + to_string(u) + " at depth " + to_string(d) + " in " + h->str());
+        }
+        
+        TreeView root = whole_tree.root();
+        check(root.invariant_hash(2) == root.neighborhood_down_to_depth(2).invariant_hash(), "tree hash of the root of " + h->str());
+    }
+}
+
+// The queries of Hypergraph, which run on its FlatHypergraph, agree with scanning the Hyperedges,
+// also after a copy and after the Hyperedges change.
+void check_queries(string str){
+    Hypergraph hg(str);
+    
+    for (int step = 0; step < 3; step++){
+        Hypergraph& h = hg;
+        vector<int> vs = h.unique_vertices().get_vertices();
+        vs.push_back(vs.back() + 1);
+        
+        for (int u : vs){
+            Hypergraph nb;
+            int c = 0;
+            for (int i = 0; i < h.size(); i++){
+                if (h.get(i).is_elem(u))
+                    nb.append(h.get(i));
+                c += h.get(i).frequency_of_vertex(u);
+            }
+            check(h.neighborhood_of_vertex(u).str() == nb.str(), "neighborhood_of_vertex " + to_string(u) + " in " + h.str());
+            check(h.frequency_of_vertex(u) == c, "frequency_of_vertex " + to_string(u) + " in " + h.str());
+        }
+        
+        for (int i = 0; i < h.size(); i++){
+            Hypergraph nb;
+            for (int j = 0; j < h.size(); j++)
+                if (h.get(j).does_intersect_with(h.get(i)))
+                    nb.append(h.get(j));
+            check(h.neighborhood_of_hyperedge(h.get(i)).str() == nb.str(), "neighborhood_of_hyperedge " + h.get(i).str() + " in " + h.str());
+            check(h.does_include(h.get(i)), "does_include " + h.get(i).str() + " in " + h.str());
+        }
+        check(!h.does_include(Hyperedge(vector<int>{vs.back()})), "not does_include in " + h.str());
+        
+        // The index of h is built by now, so the copy starts without one, and the change makes
+        // h build a new one.
+        Hypergraph copy = h;
+        check(copy.neighborhood_of_vertex(vs.front()).str() == h.neighborhood_of_vertex(vs.front()).str(), "copy of " + h.str());
+        hg.append(Hyperedge(vector<int>{vs.back(), vs.front()}));
+    }
+}
+
+void write_file(string file_name, string content){
+    ofstream out(file_name, ios::binary);
+    out << content;
+}
+
+// Whether the corpus in file_name is accepted by CorpusReader::open and reads through.
+bool corpus_reads(string file_name){
+    MappedFile file;
+    CorpusReader corpus;
+    Hypergraph hg;
+    vector<int> ai;
+    string error;
+    
+    if (!file.open(file_name) || !corpus.open(file, error))
+        return false;
+    for (long long i = 0; i < corpus.size(); i++)
+        if (!corpus.read(i, hg) || (corpus.has_ai() && !corpus.read_ai(i, ai)))
+            return false;
+    return true;
+}
+
+// A corpus of one Hypergraph, a record given as bytes, and a footer with n hypergraphs.
+string corpus_bytes(string record, unsigned long long n){
+    string buf(CORPUS_MAGIC, 4);
+    
+    put_fixed(buf, CORPUS_VERSION, 4);
+    put_fixed(buf, 0, 4);
+    put_fixed(buf, 0, 4);
+    unsigned long long index_offset = buf.size() + record.size();
+    buf += record;
+    put_fixed(buf, CORPUS_HEADER_SIZE, 8);
+    put_fixed(buf, index_offset, 8);
+    put_fixed(buf, n, 8);
+    put_fixed(buf, index_offset, 8);
+    buf.append(CORPUS_END_MAGIC, 4);
+    put_fixed(buf, 0, 4);
+    
+    return buf;
+}
+
+void check_corpus(){
+    string text = "test_corpus.txt";
+    string binary = "test_corpus.wmvc";
+    string error;
+    
+    write_file(text, "{{1,2},{2,-3}};{1,2,1}\n{{5}};{0}\n");
+    check(text_to_corpus(text, binary, error) && corpus_reads(binary), "corpus with ai lists");
+    
+    // The ai lists of the later lines are not dropped silently.
+    write_file(text, "{{1,2}}\n{{1,2},{2,3}};{0}\n");
+    check(!text_to_corpus(text, binary, error), "corpus with an unexpected ai list");
+    write_file(text, "{{1,2}};{1,1}\n{{1,2},{2,3}}\n");
+    check(!text_to_corpus(text, binary, error), "corpus with a missing ai list");
+    
+    // A failed conversion leaves neither the corpus nor its temporary file behind.
+    remove(binary.c_str());
+    write_file(text, "{{1,2}}\n{{1,2},{2,\n");
+    check(!text_to_corpus(text, binary, error) && !ifstream(binary) && !ifstream(binary + ".tmp"),
+          "no corpus after a parse error");
+    
+    // An empty text file gives an empty corpus.
+    write_file(text, "");
+    check(text_to_corpus(text, binary, error) && corpus_reads(binary) && !ifstream(binary + ".tmp"),
+          "empty corpus");
+    
+    // One Hyperedge {7}: 1 Hyperedge, arity 1, zigzag 14.
+    string record = string("\x01\x01\x0e", 3);
+    write_file(binary, corpus_bytes(record, 1));
+    check(corpus_reads(binary), "handmade corpus");
+    
+    // 8*(n+1) wraps around to 8 for this n, and with no records offsets[n] wraps around to
+    // offsets[0], which is where the index begins.
+    write_file(binary, corpus_bytes("", 1ULL << 61));
+    check(!corpus_reads(binary), "corpus with an overflowing n");
+    
+    // A vertex beyond the range of int.
+    string big;
+    put_varint(big, 1);
+    put_varint(big, 1);
+    put_zigzag(big, 1LL << 40);
+    write_file(binary, corpus_bytes(big, 1));
+    check(!corpus_reads(binary), "corpus with a vertex out of range");
+    
+    remove(text.c_str());
+    remove(binary.c_str());
+}
+
+// The index of the cache is one entry per record, in the order of the log, after every run.
+bool cache_index_is_whole(string file_name, long long num_of_records){
+    ifstream in(file_name + ".idx", ios::binary);
+    string buf((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    unsigned long long last = 0;
+    
+    if ((long long) buf.size() != 16 * num_of_records)
+        return false;
+    for (size_t k = 0; k < buf.size(); k += 16){
+        unsigned long long offset = get_fixed((const unsigned char*) buf.data() + k + 8, 8);
+        if (offset <= last)
+            return false;
+        last = offset;
+    }
+    return true;
+}
+
+void check_cache(){
+    string file_name = "test_cache.wmvr";
+    vector<string> runs[2] = {{"{{1,2},{2,3},{3,4},{4,5}}", "{{7},{32,31},{7,14,25},{31,14,31},{31}}"},
+                              {"{{-44},{-44,-27,-17},{-44,-27}}", "{{2,1},{3,2},{4,3},{5,4}}",
+                               "{{5,11},{11,5},{11,5,5},{5,5,5}}"}};
+    
+    remove(file_name.c_str());
+    remove((file_name + ".idx").c_str());
+    
+    // The second run appends records to the ones of the first, and finds the path of the first
+    // run, relabeled, among them.
+    for (int k = 0; k < 2; k++){
+        ResultCache cache;
+        string error;
+        
+        check(cache.open(file_name, error), "open the cache");
+        for (auto& str : runs[k]){
+            Hypergraph hg(str);
+            VarietyStats stats;
+            vector<int> result;
+            
+            cache.absolute_indifferences(hg, stats, [&](const vector<int>& ai){ result = ai; });
+            check(result == absolute_indifferences(hg), "cached ai list of " + str);
+        }
+        check(cache_index_is_whole(file_name, cache.size()), "cache index after run " + to_string(k+1));
+    }
+    
+    ResultCache cache;
+    string error;
+    check(cache.open(file_name, error) && (cache.size() == 4), "cache records");
+    check(cache_index_is_whole(file_name, 4), "cache index when reopened");
+    
+    // A record whose length is corrupted while the cache is open runs past the end of the log,
+    // and is a miss rather than an allocation of 4 GB. The first record is the first path above.
+    {
+        fstream log(file_name, ios::in | ios::out | ios::binary);
+        log.seekp(CACHE_HEADER_SIZE);
+        log.write("\xff\xff\xff\xf0", 4);
+    }
+    vector<int> ai_canon;
+    CanonicalForm cf = Hypergraph(runs[0][0]).canonical_form();
+    long long bytes = hot_counters().bytes_allocated;
+    check(!cache.lookup(cf, ai_canon), "cache record of a corrupt length");
+    check(hot_counters().bytes_allocated - bytes < (1 << 20), "allocation for a cache record of a corrupt length");
+    check(cache.lookup(Hypergraph(runs[0][1]).canonical_form(), ai_canon), "cache record after a corrupt one");
+    
+    remove(file_name.c_str());
+    remove((file_name + ".idx").c_str());
+}
+
+// A path through a state with an empty ai list has zero variety and is not Leibnizian, as in
+// LeibnizianPathQ.
+void check_paths(){
+    string states = "test_states.txt";
+    string edges = "test_edges.txt";
+    StateGraph graph;
+    PathQuery result;
+    string error;
+    
+    write_file(states, "0;0;{{1,2}};{1,1}\n1;1;{};{}\n2;1;{{1,2},{2,3}};{2,1,2}\n");
+    write_file(edges, "0;1\n1;2\n0;2\n");
+    
+    bool ok = graph.load(states, edges, error) && graph.query(0, 2, ai_weights()["inverse"], result, error);
+    check(ok && (result.num_of_paths == 2) && (result.num_of_leibnizian_paths == 1) &&
+          (result.min_path == vector<long long>({0, 2})), "paths through a state of zero variety");
+    
+    remove(states.c_str());
+    remove(edges.c_str());
+}
+
+int num_of_handler_calls = 0;
+
+// Gives up on the second call, as a new handler that has no more memory to free.
+void giving_up_handler(){
+    if (++num_of_handler_calls == 2)
+        set_new_handler(nullptr);
+}
+
+// An allocation that cannot succeed calls the new handler until it is removed, and then throws
+// bad_alloc; the nothrow forms return nullptr in its place.
+void check_new_handler(){
+    const size_t huge = size_t(1) << 62;
+    
+    for (size_t alignment : {size_t(0), size_t(4096)}){
+        bool thrown = false;
+        
+        num_of_handler_calls = 0;
+        set_new_handler(giving_up_handler);
+        try{
+            void* p = (alignment == 0) ? operator new(huge) : operator new(huge, align_val_t(alignment));
+            operator delete(p);
+        }
+        catch (const bad_alloc&){
+            thrown = true;
+        }
+        check(thrown && (num_of_handler_calls == 2), "new handler at alignment " + to_string(alignment));
+        
+        num_of_handler_calls = 0;
+        set_new_handler(giving_up_handler);
+        void* p = (alignment == 0) ? operator new(huge, nothrow) : operator new(huge, align_val_t(alignment), nothrow);
+        check((p == nullptr) && (num_of_handler_calls == 2), "nothrow new handler at alignment " + to_string(alignment));
+    }
+    
+    set_new_handler(nullptr);
+}
+
+int main(){
+    mt19937 rnd(1);
+    
+    check_copies("{{1,2},{2,3},{3,1}}", rnd);
+    check_copies("{{1,2,3},{3,4},{4,1,1},{2},{2}}", rnd);
+    check_copies("{{1,2},{2,3},{3,4},{4,5},{5,6},{6,1},{1,4}}", rnd);
+    check_copies("{{7},{32,31},{7,14,25},{31,14,31},{31}}", rnd);
+    check_copies("{{1,2,3},{2,3,4},{3,4,5},{4,5,6},{5,6,1},{6,1,2},{1,1,4}}", rnd);
+    
+    // Large labels on one side only; the Rule must not grow with them.
+    check_isomorphic("{{1,100000000},{100000000,3}}", "{{7,8},{8,9}}");
+    check_isomorphic("{{1,2000000000},{2000000000,3}}", "{{7,8},{8,9}}");
+    check_isomorphic("{{7,8},{8,9}}", "{{2147483647,0},{0,-2147483647}}");
+    
+    // Same numbers of vertices and Hyperedges, and same degrees.
+    check_not_isomorphic("{{1,2},{2,3},{3,1},{4,5},{5,6},{6,4}}", "{{1,2},{2,3},{3,4},{4,5},{5,6},{6,1}}");
+    check_not_isomorphic("{{1,2},{2,3}}", "{{1,2},{3,2}}");
+    check_not_isomorphic("{{1,2,3},{3,4}}", "{{1,2,3},{1,4}}");
+    check_not_isomorphic("{{1,1},{1,2}}", "{{1,2},{2,2}}");
+    
+    // Known results, on small, negative and sparse labels.
+    check_ais("{{7},{32,31},{7,14,25},{31,14,31},{31}}", {2,1,2,1,1});
+    check_ais("{{19,38},{20},{32,38},{20,32},{13,19},{38,32,32}}", {2,1,2,1,1});
+    check_ais("{{5,11},{11,5},{11,5,5},{5,5,5}}", {1,1});
+    check_ais("{{-44},{-44,-27,-17},{-44,-27}}", {2,2,1});
+    check_ais("{{-25,-50,-13},{-2000000000},{-50},{-50,-2000000000},{-25,44}}", {2,1,1,1,2});
+    
+    // Non-Leibnizian, with and without an automorphism that moves a vertex.
+    check_ais("{{1,2},{2,3},{3,1}}", {0});
+    check_ais("{{1,2},{2,3},{3,4},{4,5}}", {0});
+    check_ais("{{21},{21}}", {0});
+    check_ais("{{14,14,28},{14,28},{14,28},{14,28},{14,14,28}}", {0});
+    
+    check_tree_hashes("{{1,2,3},{3,4},{4,1,1},{2},{2}}");
+    check_tree_hashes("{{-25,-50,-13},{-2000000000},{-50},{-50,-2000000000},{-25,44}}");
+    check_tree_hashes("{{14,14,28},{14,28},{14,28},{14,28},{14,14,28}}");
+    
+    check_queries("{{1,2,3},{3,4},{4,1,1},{2},{2}}");
+    check_queries("{{-25,-50,-13},{-2000000000},{-50},{-50,-2000000000},{-25,44}}");
+    
+    check_corpus();
+    check_cache();
+    check_paths();
+    check_new_handler();
+    
+    if (num_of_failures == 0)
+        cout << "all checks passed" << endl;
+    
+    return num_of_failures;
+}
@@ -20,10 +20,221 @@
 #include "omp.h"
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <new>
 #include "Variety.h"
+#include "Allocations.h"
+#include "Input.h"
+#include "Corpus.h"
+#include "Cache.h"
+#include "Multiway.h"
+#include "Paths.h"
 
 using namespace std;
 
+// At most this many hypergraphs per thread are read ahead of the one being written.
+const int BATCH_WINDOW_PER_THREAD = 16;
+
+// An item of a batch: a line of text, or the index of a Hypergraph in a corpus.
+struct BatchItem{
+    InputLine line;
+    long long index;
+};
+
+// One hypergraph of a batch and its result. Slots are reused in a ring.
+struct BatchSlot{
+    BatchItem item;
+    string ais;
+    string error;
+    VarietyStats stats;
+    CounterSet counters;
+    double seconds;
+};
+
+// Totals of a batch.
+struct BatchTotals{
+    VarietyStats stats;
+    int num_of_hypergraphs = 0;
+    int num_of_non_leibnizian = 0;
+    int num_of_errors = 0;
+    
+    // Over all the Hypergraphs, and for each thread over all the Hypergraphs and the reading and
+    // writing, which is counted in io since it works for no single Hypergraph.
+    HotCounters counters;
+    vector<HotCounters> thread_counters;
+    CounterSet io;
+};
+
+// Hypergraphs given as lines of text. Each line is parsed by its own task, right where it
+// lies in memory, and is echoed as it is.
+class TextSource{
+    
+private:
+    LineReader lines;
+    string source;
+    
+public:
+    TextSource(const char* begin, const char* end, string source_name) : lines(begin, end){
+        source = source_name;
+    };
+    
+    bool next(BatchItem& item){
+        return lines.next(item.line);
+    };
+    
+    bool load(BatchItem& item, Hypergraph& hg, string& error){
+        return parse_line(item.line, source, hg, error);
+    };
+    
+    void write(BatchItem& item, ostream& out){
+        out.write(item.line.begin, item.line.end - item.line.begin);
+    };
+};
+
+// Hypergraphs read from a binary corpus.
+class CorpusSource{
+    
+private:
+    CorpusReader& corpus;
+    string source;
+    long long next_index = 0;
+    
+public:
+    CorpusSource(CorpusReader& reader, string source_name) : corpus(reader){
+        source = source_name;
+    };
+    
+    bool next(BatchItem& item){
+        if (next_index >= corpus.size())
+            return false;
+        item.index = next_index++;
+        return true;
+    };
+    
+    bool load(BatchItem& item, Hypergraph& hg, string& error){
+        if (corpus.read(item.index, hg))
+            return true;
+        error = source + ": error: corrupted record " + to_string(item.index);
+        return false;
+    };
+    
+    void write(BatchItem& item, ostream& out){
+        Hypergraph hg;
+        
+        corpus.read(item.index, hg);
+        out << hg.str();
+    };
+};
+
+// Reads hypergraphs one by one from the source, computes them in parallel as OpenMP tasks and
+// writes "hypergraph;ais" lines to out in the input order. Malformed hypergraphs are reported
+// on cerr and are left out of the output. The slots form a bounded reorder buffer:
+// item k goes to slot k % window, and the task dependencies make sure that a slot is written
+// out before it is reused, and that the lines are written in order. Memory is therefore
+// bounded by the window, whatever the size of the input. If cache is given, results are taken
+// from it and added to it, see Cache.h. If stats_out is given, the counters of each hypergraph
+// are written to it as a JSON line, in the same order. If verdict_only is true, the lines are
+// "hypergraph;True" or "hypergraph;False" instead, whether the hypergraph is Leibnizian (see
+// is_leibnizian), and the cache is not used.
+template <class Source>
+void process_hypergraphs(Source& source, ostream& out, int window, ResultCache* cache,
+                         ostream* stats_out, BatchTotals& totals, bool verdict_only = false){
+    vector<BatchSlot> slots(window);
+    char writer;
+    
+    totals.thread_counters.resize(slots[0].counters.size());
+    
+    #pragma omp parallel
+    #pragma omp single
+    {
+        CounterScope scope(&totals.io);
+        BatchItem item;
+        long long k = 0;
+        
+        while (source.next(item)){
+            BatchSlot* slot = &slots[k % window];
+            
+            // Wait until the previous item in this slot is written, running other tasks meanwhile.
+            if (k >= window){
+                #pragma omp taskwait depend(in: slot[0])
+            }
+            
+            slot->item = item;
+            
+            // The task is detached: it is complete once its result is set, which is later than the
+            // end of its body if it waits for an isomorphic hypergraph of the batch (see Cache.h).
+            omp_event_handle_t done;
+            #pragma omp task default(shared) firstprivate(slot) depend(inout: slot[0]) detach(done)
+            {
+                Hypergraph hg;
+                auto t0 = chrono::steady_clock::now();
+                
+                slot->stats = VarietyStats();
+                slot->error.clear();
+                slot->counters.clear();
+                
+                CounterScope scope(&slot->counters);
+                // A waiter calls finish from the task of the isomorphic hypergraph that computes it.
+                auto finish = [slot, t0, done](string ais){
+                    CounterScope scope(&slot->counters);
+                    slot->ais = ais;
+                    slot->seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+                    omp_fulfill_event(done);
+                };
+                
+                if (!source.load(slot->item, hg, slot->error))
+                    finish("");
+                else if (verdict_only)
+                    finish(is_leibnizian(hg, slot->stats) ? "True" : "False");
+                else if (cache != nullptr)
+                    cache->absolute_indifferences(hg, slot->stats, [finish](const vector<int>& ai){
+                        finish(vec_str(ai));
+                    });
+                else
+                    finish(vec_str(absolute_indifferences(hg, slot->stats)));
+            }
+            
+            // The writer tasks are chained by their dependency on writer.
+            #pragma omp task default(shared) firstprivate(slot) depend(inout: slot[0]) depend(inout: writer)
+            {
+                CounterScope scope(&totals.io);
+                HotCounters counters = slot->counters.total();
+                
+                if (slot->error.empty()){
+                    source.write(slot->item, out);
+                    out << ";" << slot->ais << "\n";
+                    totals.num_of_hypergraphs++;
+                    
+                    if (stats_out != nullptr)
+                        *stats_out << "{\"hypergraph\":" << totals.num_of_hypergraphs
+                                   << ",\"seconds\":" << slot->seconds
+                                   << ",\"vertex_pairs\":" << slot->stats.pairs_total
+                                   << ",\"pairs_computed\":" << slot->stats.pairs_computed
+                                   << ",\"leibnizian\":" << (slot->stats.leibnizian ? "true" : "false")
+                                   << ",\"by_automorphism\":" << (slot->stats.by_automorphism > 0 ? "true" : "false")
+                                   << "," << counters.json_fields() << "}\n";
+                }
+                else{
+                    cerr << slot->error << endl;
+                    totals.num_of_errors++;
+                }
+                
+                totals.stats.add(slot->stats);
+                if (!slot->stats.leibnizian)
+                    totals.num_of_non_leibnizian++;
+                totals.counters.add(counters);
+                for (int t = 0; t < slot->counters.size(); t++)
+                    totals.thread_counters[t].add(slot->counters.of_thread(t));
+            }
+            
+            k++;
+        }
+    }
+    
+    for (int t = 0; t < totals.io.size() && t < (int) totals.thread_counters.size(); t++)
+        totals.thread_counters[t].add(totals.io.of_thread(t));
+}
+
 int main(int argc, char ** argv){
 
   if (argc < 2){
@@ -31,22 +242,75 @@ int main(int argc, char ** argv){
     return 0;
   }
   
-    string argv1 = argv[1];
-
-    vector<string> hg_str;
+    // Hypergraphs given on the command line, one per line.
+    string hg_str;
 
     string file_name;
     
-    if (argv1 == "-f"){
-      string line;
-      file_name = argv[2];
-      ifstream file(file_name);
+    // Results of earlier runs, see Cache.h.
+    string cache_file_name;
+    
+    // Multiway evolution, see Multiway.h.
+    string rules_str, init_str;
+    int generations = -1;
+    
+    // Counters of each hypergraph, see HotCounters.
+    bool with_stats = false;
+    
+    // Only whether each hypergraph is Leibnizian, see is_leibnizian.
+    bool verdict_only = false;
+    
+    // Path queries over the states graph, see Paths.h.
+    vector<string> paths_args;
+    string weight_name = "inverse";
+    
+    // By default all cores are used (or OMP_NUM_THREADS if it is set).
+    int num_threads = omp_get_max_threads();
+    
+    for (int i = 1; i < argc; i++){
+      string arg = argv[i];
       
-      while(getline(file,line))
-	hg_str.push_back(line); //We add HG strings to the vector.
-    }
-    else{
-      hg_str.push_back(argv1); //We suppose that if argv != "-f" then it is an HG string
+      if ((arg == "-f") && (i+1 < argc)){
+        file_name = argv[++i];
+      }
+      else if ((arg == "--cache") && (i+1 < argc)){
+        cache_file_name = argv[++i];
+      }
+      else if ((arg == "-m") && (i+3 < argc)){
+        rules_str = argv[++i];
+        init_str = argv[++i];
+        generations = stoi(argv[++i]);
+      }
+      else if ((arg == "--paths") && (i+4 < argc)){
+        paths_args.assign(argv + i + 1, argv + i + 5);
+        i += 4;
+      }
+      else if (arg == "--stats"){
+        with_stats = true;
+      }
+      else if (arg == "--leibnizian"){
+        verdict_only = true;
+      }
+      else if ((arg == "--weight") && (i+1 < argc)){
+        weight_name = argv[++i];
+      }
+      else if ((arg == "-t") && (i+1 < argc)){
+        num_threads = stoi(argv[++i]);
+      }
+      else if (((arg == "--to-binary") || (arg == "--to-text")) && (i+2 < argc)){
+        // Conversion between the text format and the binary corpus format, see Corpus.h.
+        string error;
+        bool ok = (arg == "--to-binary") ? text_to_corpus(argv[i+1], argv[i+2], error)
+                                         : corpus_to_text(argv[i+1], argv[i+2], error);
+        if (!ok){
+            cerr << error << endl;
+            return 1;
+        }
+        return 0;
+      }
+      else{
+        hg_str += arg + "\n"; //We suppose that any other argument is an HG string
+      }
     }
 
     //Here we print the list of ais for each HG.
@@ -54,17 +318,143 @@ int main(int argc, char ** argv){
     //This gives flexibility about which variety function to use.
     //The canonical choice is sum_i 1/ai;
 
-    string output_file_name = file_name + "_hg_and_ais.txt";
+    omp_set_num_threads(num_threads);
+    
+    // Actions of the paths between two states of a states graph written by -m.
+    if (!paths_args.empty()){
+        map<string, AiWeight> weights = ai_weights();
+        StateGraph graph;
+        PathQuery result;
+        string error;
+        long long source = stoll(paths_args[2]);
+        long long target = stoll(paths_args[3]);
+        
+        if (weights.count(weight_name) == 0){
+            cerr << "Error: unknown weight " << weight_name << endl;
+            return 1;
+        }
+        if (!graph.load(paths_args[0], paths_args[1], error)){
+            cerr << error << endl;
+            return 1;
+        }
+        if (!graph.has_state(source) || !graph.has_state(target)){
+            cerr << "Error: no such state" << endl;
+            return 1;
+        }
+        if (!graph.query(source, target, weights[weight_name], result, error)){
+            cerr << "Error: " << error << endl;
+            return 1;
+        }
+        
+        cout << path_query_str(result) << endl;
+        return 0;
+    }
+
+    if (verdict_only && ((cache_file_name != "") || (generations >= 0))){
+        cerr << "Error: --leibnizian cannot be used with --cache or -m" << endl;
+        return 1;
+    }
+    
+    BatchTotals totals;
+    const int window = BATCH_WINDOW_PER_THREAD * num_threads;
+    
+    ResultCache result_cache;
+    ResultCache* cache = nullptr;
+    if (cache_file_name != ""){
+        string error;
+        
+        if (!result_cache.open(cache_file_name, error)){
+            cerr << error << endl;
+            return 1;
+        }
+        cache = &result_cache;
+    }
+    
+    // The states of the multiway system and their ai lists are computed here, instead of being
+    // read from a file.
+    if (generations >= 0){
+        vector<WolframRule> rules;
+        string error;
+        const char* error_pos;
+        const char* error_msg;
+        vector<int> vertices;
+        vector<int> offsets(1, 0);
+        
+        if (!parse_rules(rules_str, rules, error)){
+            cerr << "Error: " << error << endl;
+            return 1;
+        }
+        if (!parse_hypergraph(init_str.data(), init_str.data() + init_str.size(), vertices, offsets, error_pos, error_msg)){
+            cerr << "Error: initial state: " << error_msg << endl;
+            return 1;
+        }
+        
+        ofstream states_file("multiway_states_and_ais.txt");
+        ofstream edges_file("multiway_edges.txt");
+        MultiwaySystem system(rules);
+        MultiwayCounts counts;
+        
+        system.evolve(Hypergraph(vertices, offsets), generations, states_file, edges_file, cache, counts);
+        
+        cout << multiway_counts_str(counts) << endl;
+        cout << variety_stats_str(counts.stats, counts.states, counts.non_leibnizian) << endl;
+        cout << iso_counters_str(counts.counters.total()) << endl;
+        if (cache != nullptr)
+            cout << cache->stats_str() << endl;
+        return 0;
+    }
+    
+    string output_file_name = file_name + (verdict_only ? "_leibnizian.txt" : "_hg_and_ais.txt");
     ofstream output_file(output_file_name);
     
-    omp_set_num_threads(8);
+    ofstream stats_file;
+    if (with_stats)
+        stats_file.open(file_name + "_stats.jsonl");
+    ostream* stats_out = with_stats ? &stats_file : nullptr;
 
-    for(string str : hg_str){
-        output_file << str << ";";
-        output_file << variety_omp_str(str) << endl;
+    // The file is mapped into memory and read line by line (or record by record if it is a
+    // binary corpus), the whole hypergraphs are shared among the threads.
+    if (file_name != ""){
+        MappedFile file;
+        
+        if (!file.open(file_name)){
+            cout << "Error: cannot open " << file_name << endl;
+            return 1;
+        }
+        
+        if (is_corpus_file(file)){
+            CorpusReader corpus;
+            string error;
+            
+            if (!corpus.open(file, error)){
+                cerr << file_name << ": " << error << endl;
+                return 1;
+            }
+            CorpusSource source(corpus, file_name);
+            process_hypergraphs(source, output_file, window, cache, stats_out, totals, verdict_only);
+        }
+        else{
+            TextSource source(file.begin(), file.end(), file_name);
+            process_hypergraphs(source, output_file, window, cache, stats_out, totals, verdict_only);
+        }
+    }
+    else{
+        TextSource source(hg_str.data(), hg_str.data() + hg_str.size(), "argument");
+        process_hypergraphs(source, output_file, window, cache, stats_out, totals, verdict_only);
     }
     
     output_file.close();
     
-    return 0;
+    // The work of each thread over the whole run follows the lines of the hypergraphs.
+    if (with_stats)
+        for (int t = 0; t < (int) totals.thread_counters.size(); t++)
+            stats_file << "{\"thread\":" << t << "," << totals.thread_counters[t].json_fields() << "}\n";
+    
+    cout << variety_stats_str(totals.stats, totals.num_of_hypergraphs, totals.num_of_non_leibnizian) << endl;
+    cout << iso_counters_str(totals.counters) << endl;
+    if (cache != nullptr)
+        cout << cache->stats_str() << endl;
+    
+    // Malformed lines make the exit status nonzero.
+    return (totals.num_of_errors > 0) ? 1 : 0;
 }